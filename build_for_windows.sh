@@ -2,7 +2,7 @@
 
 pwd
 
-gcc -I/usr/include/libusb-1.0 daemon/xvcpico.c -o xvcd-pico.exe -lusb-1.0
+gcc -I/usr/include/libusb-1.0 daemon/xvcd.c daemon/xvcpico.c daemon/libxvcpico.c daemon/tap.c daemon/svf.c daemon/trace.c daemon/chain.c daemon/store.c daemon/spiflash.c daemon/stream.c daemon/usbthread.c -o xvcd-pico.exe -lusb-1.0 -lpthread
 
 find /bin -name cygwin1.dll -exec cp {} . \;
 
@@ -0,0 +1,156 @@
+/*
+   JTAG chain discovery, see chain.h.
+
+   After Test-Logic-Reset every TAP has IDCODE or BYPASS in its instruction
+   register. A DR scan of ones then returns a 32-bit IDCODE (bit 0 set) or a
+   single 0 per device, followed by the ones that went in. The total IR length
+   is what it takes for a 1 to appear at TDO after the IR was filled with
+   zeros. Per-device IR lengths come from a table of known parts, a single
+   unknown device gets what is left.
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "chain.h"
+#include "tap.h"
+#include "xvcpico.h"
+
+#define SCAN_BITS (CHAIN_MAX * 32 + 32)
+#define IR_MAX (CHAIN_MAX * 32)
+
+static const struct {
+  uint32_t mask;
+  uint32_t idcode;
+  int ir_len;
+  const char *name;
+} known[] = {
+  { 0x0fffffff, 0x0ba00477, 4, "ARM DAP" },
+  { 0x00000fff, 0x00000093, 6, "Xilinx" },
+};
+
+static uint8_t tms[(2 * IR_MAX + 7) / 8], tdi[(2 * IR_MAX + 7) / 8], tdo[(2 * IR_MAX + 7) / 8];
+
+static int get_bit(const uint8_t *v, uint32_t bit) {
+  return (v[bit / 8] >> (bit % 8)) & 1;
+}
+
+static void go(enum tap_state from, enum tap_state to) {
+  uint32_t path;
+  int n = tap_path(from, to, &path);
+  uint8_t t[4] = { path, path >> 8, path >> 16, path >> 24 };
+  uint8_t d[4] = { 0xff, 0xff, 0xff, 0xff };
+  uint8_t o[4];
+
+  if (n)
+    xvc_shift(n, t, d, o, NULL);
+}
+
+// Shift `len` bits with TMS low, staying in the shift state
+static void scan(uint32_t len) {
+  memset(tms, 0, sizeof(tms));
+  xvc_shift(len, tms, tdi, tdo, NULL);
+}
+
+int chain_scan(struct chain_device *dev, int max) {
+  int count = 0, ir_total = -1, known_sum = 0, unknown = 0;
+  uint32_t bit = 0;
+
+  if (max > CHAIN_MAX)
+    max = CHAIN_MAX;
+
+  // IDCODEs
+  go(TAP_RESET, TAP_RESET);
+  go(TAP_RESET, TAP_DRSHIFT);
+  memset(tdi, 0xff, sizeof(tdi));
+  scan(SCAN_BITS);
+  go(TAP_DRSHIFT, TAP_IDLE);
+  for (;;) {
+    uint32_t id = 0;
+
+    if (bit >= SCAN_BITS) {
+      fprintf(stderr, "JTAG chain: TDO stuck low?\n");
+      return -1;
+    }
+    if (!get_bit(tdo, bit)) {
+      id = 0;
+      bit++;
+    } else {
+      if (bit + 32 > SCAN_BITS) {
+        fprintf(stderr, "JTAG chain: more than %d devices?\n", max);
+        return -1;
+      }
+      for (int i = 0; i < 32; i++)
+        id |= (uint32_t)get_bit(tdo, bit + i) << i;
+      bit += 32;
+      if (id == 0xffffffff)
+        break;
+    }
+    if (count == max) {
+      fprintf(stderr, "JTAG chain: more than %d devices?\n", max);
+      return -1;
+    }
+    dev[count].idcode = id;
+    dev[count].ir_len = -1;
+    dev[count].name = NULL;
+    for (size_t k = 0; id && k < sizeof(known) / sizeof(known[0]); k++) {
+      if ((id & known[k].mask) == known[k].idcode) {
+        dev[count].ir_len = known[k].ir_len;
+        dev[count].name = known[k].name;
+        break;
+      }
+    }
+    count++;
+  }
+  if (count == 0) {
+    fprintf(stderr, "JTAG chain: no devices found\n");
+    return 0;
+  }
+
+  // Total IR length: zeros first, then count ones until the first comes out.
+  // The IR ends up all ones, which is BYPASS for every device.
+  go(TAP_IDLE, TAP_IRSHIFT);
+  memset(tdi, 0, IR_MAX / 8);
+  memset(tdi + IR_MAX / 8, 0xff, IR_MAX / 8);
+  scan(2 * IR_MAX);
+  go(TAP_IRSHIFT, TAP_IDLE);
+  for (uint32_t i = 0; i < IR_MAX; i++) {
+    if (get_bit(tdo, IR_MAX + i)) {
+      ir_total = i;
+      break;
+    }
+  }
+  go(TAP_IDLE, TAP_RESET);
+  go(TAP_RESET, TAP_IDLE);
+
+  for (int d = 0; d < count; d++) {
+    if (dev[d].ir_len < 0)
+      unknown++;
+    else
+      known_sum += dev[d].ir_len;
+  }
+  if (unknown == 1 && ir_total > known_sum) {
+    for (int d = 0; d < count; d++)
+      if (dev[d].ir_len < 0)
+        dev[d].ir_len = ir_total - known_sum;
+  } else if (unknown == 0 && ir_total != known_sum) {
+    // Some part has an IR the table doesn't know about
+    for (int d = 0; d < count; d++)
+      dev[d].ir_len = -1;
+  }
+
+  fprintf(stderr, "JTAG chain: %d device(s), IR %d bits\n", count, ir_total);
+  for (int d = 0; d < count; d++) {
+    if (dev[d].idcode)
+      fprintf(stderr, "  %d: 0x%08x", d, dev[d].idcode);
+    else
+      fprintf(stderr, "  %d: (bypass)  ", d);
+    if (dev[d].ir_len >= 0)
+      fprintf(stderr, " IR %2d", dev[d].ir_len);
+    else
+      fprintf(stderr, " IR  ?");
+    fprintf(stderr, "  %s\n", dev[d].name ? dev[d].name : "");
+  }
+  return count;
+}
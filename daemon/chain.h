@@ -0,0 +1,24 @@
+/*
+   JTAG chain discovery: IDCODEs and IR lengths of the devices between TDI
+   and TDO, read once at startup.
+*/
+
+#ifndef CHAIN_H
+#define CHAIN_H
+
+#include <stdint.h>
+
+#define CHAIN_MAX 32
+
+struct chain_device {
+  uint32_t idcode;   // 0 for a device that answered with BYPASS
+  int ir_len;        // -1 when it can't be told apart from its neighbours
+  const char *name;  // NULL if unknown
+};
+
+// Scan the chain and print it. Device 0 is the one nearest to TDO. Returns
+// the number of devices, -1 if the chain looks broken. The TAPs are left in
+// Run-Test/Idle with IDCODE (or BYPASS) loaded.
+int chain_scan(struct chain_device *dev, int max);
+
+#endif
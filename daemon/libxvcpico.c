@@ -0,0 +1,290 @@
+/*
+   Batched scans on top of xvc_shift(), see libxvcpico.h.
+
+   The worker thread owns the Pico while batches are queued. Every batch is
+   packed into one TMS/TDI vector, shifted, and its TDO is unpacked into the
+   scans.
+*/
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libxvcpico.h"
+#include "tap.h"
+#include "xvcpico.h"
+
+static pthread_t worker;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t finished = PTHREAD_COND_INITIALIZER;
+static struct xvcpico_batch *head, *tail;
+static int running, stopping;
+
+// Packed vectors of the batch being shifted, grown as needed
+static uint8_t *pack_tms, *pack_tdi, *pack_tdo;
+static uint32_t vec_bits;
+
+static int vec_reserve(uint32_t bits) {
+  uint32_t size = vec_bits ? vec_bits : 65536;
+  uint8_t *p;
+
+  if (bits <= vec_bits)
+    return 0;
+  while (size < bits)
+    size *= 2;
+  if (!(p = realloc(pack_tms, size / 8)))
+    return -1;
+  pack_tms = p;
+  if (!(p = realloc(pack_tdi, size / 8)))
+    return -1;
+  pack_tdi = p;
+  if (!(p = realloc(pack_tdo, size / 8)))
+    return -1;
+  pack_tdo = p;
+  vec_bits = size;
+  return 0;
+}
+
+static int get_bit(const uint8_t *v, uint32_t bit) {
+  return (v[bit / 8] >> (bit % 8)) & 1;
+}
+
+static void put_bit(uint8_t *v, uint32_t bit, int value) {
+  if (value)
+    v[bit / 8] |= 1 << (bit % 8);
+  else
+    v[bit / 8] &= ~(1 << (bit % 8));
+}
+
+// Copy `n` bits, whole bytes at a time when both ends are byte aligned
+static void copy_bits(uint8_t *dst, uint32_t to, const uint8_t *src, uint32_t from, uint32_t n) {
+  if (to % 8 == 0 && from % 8 == 0) {
+    memcpy(&dst[to / 8], &src[from / 8], n / 8);
+    to += n / 8 * 8;
+    from += n / 8 * 8;
+    n %= 8;
+  }
+  for (uint32_t i = 0; i < n; i++)
+    put_bit(dst, to + i, get_bit(src, from + i));
+}
+
+// Set `n` bits to `value`
+static void fill_bits(uint8_t *dst, uint32_t to, int value, uint32_t n) {
+  for (; n && to % 8; n--)
+    put_bit(dst, to++, value);
+  memset(&dst[to / 8], value ? 0xFF : 0x00, n / 8);
+  to += n / 8 * 8;
+  for (n %= 8; n; n--)
+    put_bit(dst, to++, value);
+}
+
+// TMS path between two states, TDI high
+static uint32_t put_path(uint32_t pos, enum tap_state from, enum tap_state to) {
+  uint32_t path;
+  int n = tap_path(from, to, &path);
+
+  for (int i = 0; i < n; i++) {
+    put_bit(pack_tms, pos + i, (path >> i) & 1);
+    put_bit(pack_tdi, pos + i, 1);
+  }
+  return pos + n;
+}
+
+// Bits a scan takes in the packed vectors, -1 if it is invalid
+static int64_t scan_bits(const struct xvcpico_scan *scan) {
+  enum tap_state shift = scan->kind == XVCPICO_SCAN_IR ? TAP_IRSHIFT : TAP_DRSHIFT;
+  uint32_t path;
+
+  if (scan->bits && !scan->tdi)
+    return -1;
+  switch (scan->kind) {
+    case XVCPICO_SCAN_RAW:
+      if (scan->bits && !scan->tms)
+        return -1;
+      return scan->bits;
+    case XVCPICO_SCAN_IR:
+    case XVCPICO_SCAN_DR:
+      if (!scan->bits)
+        return 0;
+      return tap_path(TAP_IDLE, shift, &path) + scan->bits + tap_path(shift == TAP_IRSHIFT ? TAP_IREXIT1 : TAP_DREXIT1, TAP_IDLE, &path);
+  }
+  return -1;
+}
+
+static int batch_run(struct xvcpico_batch *batch) {
+  uint64_t total = 0;
+  uint32_t pos = 0;
+  uint32_t *start;
+
+  for (int i = 0; i < batch->count; i++) {
+    int64_t bits = scan_bits(&batch->scans[i]);
+    if (bits < 0)
+      return -1;
+    total += bits;
+  }
+  if (total > UINT32_MAX - 8 || vec_reserve(total + 8))
+    return -1;
+  start = malloc(sizeof(*start) * (batch->count ? batch->count : 1));
+  if (!start)
+    return -1;
+
+  for (int i = 0; i < batch->count; i++) {
+    const struct xvcpico_scan *scan = &batch->scans[i];
+    int ir = scan->kind == XVCPICO_SCAN_IR;
+
+    if (scan->kind == XVCPICO_SCAN_RAW) {
+      start[i] = pos;
+      copy_bits(pack_tms, pos, scan->tms, 0, scan->bits);
+      copy_bits(pack_tdi, pos, scan->tdi, 0, scan->bits);
+      pos += scan->bits;
+      continue;
+    }
+    if (!scan->bits)
+      continue;
+    pos = put_path(pos, TAP_IDLE, ir ? TAP_IRSHIFT : TAP_DRSHIFT);
+    start[i] = pos;
+    fill_bits(pack_tms, pos, 0, scan->bits);
+    copy_bits(pack_tdi, pos, scan->tdi, 0, scan->bits);
+    pos += scan->bits;
+    put_bit(pack_tms, pos - 1, 1);  // the last bit goes to Exit1
+    pos = put_path(pos, ir ? TAP_IREXIT1 : TAP_DREXIT1, TAP_IDLE);
+  }
+
+  if (pos && xvc_shift(pos, pack_tms, pack_tdi, pack_tdo, NULL)) {
+    free(start);
+    return -1;
+  }
+
+  for (int i = 0; i < batch->count; i++) {
+    const struct xvcpico_scan *scan = &batch->scans[i];
+
+    if (scan->tdo && scan->bits) {
+      copy_bits(scan->tdo, 0, pack_tdo, start[i], scan->bits);
+      if (scan->bits % 8)
+        scan->tdo[scan->bits / 8] &= 0xFF >> (8 - scan->bits % 8);
+    }
+  }
+  free(start);
+  return 0;
+}
+
+static void *worker_main(void *arg) {
+  (void)arg;
+
+  pthread_mutex_lock(&lock);
+  while (1) {
+    struct xvcpico_batch *batch = head;
+
+    if (!batch) {
+      if (stopping)
+        break;
+      pthread_cond_wait(&queued, &lock);
+      continue;
+    }
+    head = batch->next;
+    if (!head)
+      tail = NULL;
+    pthread_mutex_unlock(&lock);
+
+    batch->status = batch_run(batch);
+    if (batch->done)
+      batch->done(batch);
+
+    pthread_mutex_lock(&lock);
+    batch->finished = 1;
+    pthread_cond_broadcast(&finished);
+  }
+  pthread_mutex_unlock(&lock);
+  return NULL;
+}
+
+int xvcpico_open(int gang_targets) {
+  int ep_size;
+
+  if (running)
+    return -1;
+  if (gang_targets < 1 || gang_targets > GANG_MAX) {
+    fprintf(stderr, "gang mode supports 1 to %d targets\n", GANG_MAX);
+    return -1;
+  }
+  ep_size = device_init();
+  if (ep_size < 0)
+    return -1;
+  pico_replay_wait();
+  if (gang_targets > 1 && gpio_gang(gang_targets)) {
+    device_close();
+    return -1;
+  }
+  tap_reset_probe();
+
+  stopping = 0;
+  if (pthread_create(&worker, NULL, worker_main, NULL)) {
+    perror("pthread_create");
+    device_close();
+    return -1;
+  }
+  running = 1;
+  return 0;
+}
+
+void xvcpico_close(void) {
+  if (!running)
+    return;
+  pthread_mutex_lock(&lock);
+  stopping = 1;
+  pthread_cond_signal(&queued);
+  pthread_mutex_unlock(&lock);
+  pthread_join(worker, NULL);
+  running = 0;
+
+  device_close();
+  free(pack_tms);
+  free(pack_tdi);
+  free(pack_tdo);
+  pack_tms = pack_tdi = pack_tdo = NULL;
+  vec_bits = 0;
+}
+
+int xvcpico_submit(struct xvcpico_batch *batch) {
+  // A rejected batch is finished right away, so xvcpico_wait() returns
+  batch->status = -1;
+  batch->finished = 1;
+  batch->next = NULL;
+  if (!running || batch->count < 0 || (batch->count && !batch->scans))
+    return -1;
+
+  pthread_mutex_lock(&lock);
+  if (stopping) {
+    pthread_mutex_unlock(&lock);
+    return -1;
+  }
+  batch->finished = 0;
+  if (tail)
+    tail->next = batch;
+  else
+    head = batch;
+  tail = batch;
+  pthread_cond_signal(&queued);
+  pthread_mutex_unlock(&lock);
+  return 0;
+}
+
+int xvcpico_wait(struct xvcpico_batch *batch) {
+  pthread_mutex_lock(&lock);
+  while (!batch->finished)
+    pthread_cond_wait(&finished, &lock);
+  pthread_mutex_unlock(&lock);
+  return batch->status;
+}
+
+int xvcpico_shift(uint32_t bits, const uint8_t *tms, const uint8_t *tdi, uint8_t *tdo) {
+  struct xvcpico_scan scan = { XVCPICO_SCAN_RAW, bits, tms, tdi, tdo };
+  struct xvcpico_batch batch = { .scans = &scan, .count = 1 };
+
+  if (xvcpico_submit(&batch))
+    return -1;
+  return xvcpico_wait(&batch);
+}
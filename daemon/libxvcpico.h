@@ -0,0 +1,87 @@
+/*
+   libxvcpico: drive the xvc-pico firmware from your own program, without an
+   XVC client and a TCP connection in between.
+
+   Scans are handed over in batches. All scans of a batch go to the Pico as
+   one shift, so they are pipelined over USB like one large XVC "shift:".
+   Batches are queued and worked off by a thread of the library in the order
+   they were submitted. xvcpico_submit() returns at once, the TDO of every
+   scan is in place when the batch is done.
+
+   IR and DR scans start and end in Run-Test/Idle, the library adds the TMS
+   bits to get to Shift-IR/Shift-DR and back. Raw scans are clocked exactly
+   as given.
+
+   Only one Pico per process. Link against the xvcpico library (see
+   daemon/CMakeLists.txt).
+*/
+
+#ifndef LIBXVCPICO_H
+#define LIBXVCPICO_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum xvcpico_scan_kind {
+  XVCPICO_SCAN_RAW,
+  XVCPICO_SCAN_IR,
+  XVCPICO_SCAN_DR,
+};
+
+// Vectors are LSB first, like in XVC "shift:"
+struct xvcpico_scan {
+  enum xvcpico_scan_kind kind;
+  uint32_t bits;
+  const uint8_t *tms;  // XVCPICO_SCAN_RAW only
+  const uint8_t *tdi;
+  uint8_t *tdo;        // may be NULL
+};
+
+struct xvcpico_batch {
+  struct xvcpico_scan *scans;
+  int count;
+  // Called from the library's thread once the TDO of all scans is in place.
+  // May be NULL.
+  void (*done)(struct xvcpico_batch *batch);
+  void *user;
+  int status;  // 0 once done, -1 on errors
+
+  // Private
+  struct xvcpico_batch *next;
+  int finished;
+};
+
+/**
+ * Open the first Pico found and walk every TAP to Run-Test/Idle.
+ *
+ * @param gang_targets 1, or up to 4 identical targets driven at once
+ * @return 0 on success, -1 on errors
+ */
+int xvcpico_open(int gang_targets);
+
+// Finish the queued batches and close the Pico
+void xvcpico_close(void);
+
+/**
+ * Queue a batch. The batch and the vectors it points to must stay valid
+ * until it is done.
+ *
+ * @return 0 if the batch was queued, -1 on errors. A rejected batch is
+ *         done right away with status -1.
+ */
+int xvcpico_submit(struct xvcpico_batch *batch);
+
+// Wait until the batch is done, returns its status
+int xvcpico_wait(struct xvcpico_batch *batch);
+
+// Shift a single raw scan and wait for it
+int xvcpico_shift(uint32_t bits, const uint8_t *tms, const uint8_t *tdi, uint8_t *tdo);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
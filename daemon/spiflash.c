@@ -0,0 +1,238 @@
+/*
+   Configuration flash programming through the Pico's SPI pins, see
+   firmware/spiflash.h.
+
+   The FPGA must keep its hands off the flash meanwhile. JPROGRAM clears its
+   configuration and, for as long as it stays in the instruction register,
+   holds it in that state like a low PROGRAM_B. Loading BYPASS afterwards
+   lets it boot from the new image.
+
+   Only 3-byte addressing is used, so flashes up to 16 MiB.
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "chain.h"
+#include "libxvcpico.h"
+#include "xvcpico.h"
+
+#define FLASH_WREN 0x06
+#define FLASH_RDSR 0x05
+#define FLASH_READ 0x03
+#define FLASH_PP 0x02
+#define FLASH_BE64 0xD8
+#define FLASH_RDID 0x9F
+
+#define FLASH_BP_MASK 0x1C  // block protect bits of the status register
+#define PAGE_SIZE 256
+#define BLOCK_SIZE 65536
+#define MAX_SIZE (16 * 1024 * 1024)
+
+// SPI_WAIT answers left unread while the next commands go out
+#define WAIT_LAG 4
+
+// 7 series and UltraScale, 6-bit IR
+#define XILINX_JPROGRAM 0x0B
+
+static double seconds_since(const struct timespec *t0) {
+  struct timespec t1;
+
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  return (t1.tv_sec - t0->tv_sec) + (t1.tv_nsec - t0->tv_nsec) / 1e9;
+}
+
+// Load `instr` into device `target`, BYPASS into all others
+static int load_ir(const struct chain_device *chain, int count, int target, uint32_t instr) {
+  uint8_t tdi[CHAIN_MAX * 4];
+  uint32_t bits = 0;
+
+  memset(tdi, 0xFF, sizeof(tdi));
+  for (int i = 0; i < count; i++) {
+    if (i == target) {
+      for (int b = 0; b < chain[i].ir_len; b++) {
+        if (!((instr >> b) & 1))
+          tdi[(bits + b) / 8] &= ~(1 << ((bits + b) % 8));
+      }
+    }
+    bits += chain[i].ir_len;
+  }
+
+  struct xvcpico_scan scan = { XVCPICO_SCAN_IR, bits, NULL, tdi, NULL };
+  struct xvcpico_batch batch = { .scans = &scan, .count = 1 };
+  if (xvcpico_submit(&batch))
+    return -1;
+  return xvcpico_wait(&batch);
+}
+
+// The FPGA to hold, -1 if there is none we know how to hold
+static int find_fpga(const struct chain_device *chain, int count) {
+  int fpga = -1;
+
+  for (int i = 0; i < count; i++) {
+    if (chain[i].ir_len < 1)
+      return -1;  // can't build the IR vector
+    if (fpga < 0 && chain[i].name && strcmp(chain[i].name, "Xilinx") == 0 && chain[i].ir_len == 6)
+      fpga = i;
+  }
+  return fpga;
+}
+
+static int flash_id(uint32_t *size) {
+  const uint8_t cmd = FLASH_RDID;
+  uint8_t id[3];
+
+  if (pico_spi_write(&cmd, 1, 1) || pico_spi_read(id, sizeof(id), 0))
+    return -1;
+  printf("spi: flash id %02x %02x %02x", id[0], id[1], id[2]);
+  if ((id[0] == 0xFF && id[1] == 0xFF) || (id[0] == 0x00 && id[1] == 0x00)) {
+    printf(", no flash found\n");
+    return -1;
+  }
+  // The third byte is log2 of the size for nearly every vendor
+  *size = id[2] >= 16 && id[2] <= 24 ? 1u << id[2] : MAX_SIZE;
+  printf(", %u KiB\n", *size / 1024);
+  return 0;
+}
+
+static int flash_status(uint8_t *status) {
+  const uint8_t cmd = FLASH_RDSR;
+
+  return pico_spi_write(&cmd, 1, 1) || pico_spi_read(status, 1, 0) ? -1 : 0;
+}
+
+// Command with a 3-byte address, the data (if any) follows in the same
+// CS cycle
+static int flash_cmd(uint8_t op, uint32_t address, const uint8_t *data, uint32_t len) {
+  const uint8_t wren = FLASH_WREN;
+  uint8_t cmd[4] = { op, address >> 16, address >> 8, address };
+
+  if (pico_spi_write(&wren, 1, 0) || pico_spi_write(cmd, 4, len != 0))
+    return -1;
+  if (len && pico_spi_write(data, len, 0))
+    return -1;
+  return pico_spi_wait(WAIT_LAG) ? -1 : 0;
+}
+
+static int flash_erase(uint32_t size) {
+  struct timespec t0;
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (uint32_t a = 0; a < size; a += BLOCK_SIZE) {
+    if (flash_cmd(FLASH_BE64, a, NULL, 0))
+      return -1;
+  }
+  if (pico_spi_sync())
+    return -1;
+  printf("spi: erased %u KiB in %.2f s\n", (size + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE / 1024,
+         seconds_since(&t0));
+  return 0;
+}
+
+static int flash_write(const uint8_t *image, uint32_t size) {
+  static uint8_t blank[PAGE_SIZE];
+  struct timespec t0;
+
+  memset(blank, 0xFF, sizeof(blank));
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (uint32_t a = 0; a < size; a += PAGE_SIZE) {
+    uint32_t n = size - a < PAGE_SIZE ? size - a : PAGE_SIZE;
+    // Erased pages are left alone
+    if (memcmp(&image[a], blank, n) != 0 && flash_cmd(FLASH_PP, a, &image[a], n))
+      return -1;
+  }
+  if (pico_spi_sync())
+    return -1;
+  double t = seconds_since(&t0);
+  printf("spi: programmed %u bytes in %.2f s (%.0f KB/s)\n", size, t, size / t / 1e3);
+  return 0;
+}
+
+static int flash_verify(const uint8_t *image, uint32_t size) {
+  const uint8_t cmd[4] = { FLASH_READ, 0, 0, 0 };
+  uint8_t *data = malloc(size);
+  struct timespec t0;
+  int ret = -1;
+
+  if (!data)
+    return -1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  if (pico_spi_write(cmd, sizeof(cmd), 1) || pico_spi_read(data, size, 0))
+    goto out;
+  for (uint32_t i = 0; i < size; i++) {
+    if (data[i] != image[i]) {
+      printf("spi: verify FAILED at offset 0x%06x: %02x, expected %02x\n", i, data[i], image[i]);
+      goto out;
+    }
+  }
+  double t = seconds_since(&t0);
+  printf("spi: verified %u bytes in %.2f s (%.0f KB/s)\n", size, t, size / t / 1e3);
+  ret = 0;
+out:
+  free(data);
+  return ret;
+}
+
+static uint8_t *load(const char *path, uint32_t *size) {
+  FILE *f = fopen(path, "rb");
+  uint8_t *data = NULL;
+  long n;
+
+  if (!f) {
+    perror(path);
+    return NULL;
+  }
+  if (fseek(f, 0, SEEK_END) == 0 && (n = ftell(f)) > 0 && n <= MAX_SIZE && fseek(f, 0, SEEK_SET) == 0) {
+    data = malloc(n);
+    if (data && fread(data, 1, n, f) != (size_t)n) {
+      free(data);
+      data = NULL;
+    }
+    *size = n;
+  }
+  if (!data)
+    fprintf(stderr, "%s: can't read it, or larger than %d MiB\n", path, MAX_SIZE >> 20);
+  fclose(f);
+  return data;
+}
+
+int spiflash_program(const char *path, int verify_only, const struct chain_device *chain, int count) {
+  uint32_t size, flash_size;
+  uint8_t status;
+  int fpga, ret = -1;
+  uint8_t *image = load(path, &size);
+
+  if (!image)
+    return -1;
+
+  fpga = find_fpga(chain, count);
+  if (fpga < 0)
+    printf("spi: no Xilinx FPGA in the JTAG chain, it is not held in reset\n");
+  else if (load_ir(chain, count, fpga, XILINX_JPROGRAM))
+    goto out;
+
+  if (pico_spi(1) || flash_id(&flash_size) || flash_status(&status))
+    goto off;
+  if (size > flash_size) {
+    fprintf(stderr, "spi: %s does not fit into the flash\n", path);
+    goto off;
+  }
+  if (!verify_only && (status & FLASH_BP_MASK)) {
+    fprintf(stderr, "spi: the flash is write protected (status 0x%02x)\n", status);
+    goto off;
+  }
+  if (verify_only || (flash_erase(size) == 0 && flash_write(image, size) == 0))
+    ret = flash_verify(image, size);
+
+off:
+  pico_spi(0);
+  // Let the FPGA boot from the flash
+  if (fpga >= 0 && load_ir(chain, count, -1, 0) == 0 && ret == 0 && !verify_only)
+    printf("spi: FPGA released, it configures itself from the flash now\n");
+out:
+  free(image);
+  return ret;
+}
@@ -0,0 +1,238 @@
+/*
+   Flash images for the Pico's image store, see firmware/store.h.
+
+   An SVF/XSVF file is compiled with svf_compile() into the list of JTAG
+   operations the Pico replays by itself. Bytes with TDO checks go out as
+   IMG_CHECK, constant runs as IMG_PAD, TMS-low data (nearly all of a
+   bitstream) as IMG_TDI and the rest as IMG_PAIRS. A trailing partial byte
+   becomes IMG_BITS.
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "xvcpico.h"
+
+// Keep in sync with firmware/store.h
+enum {
+  IMG_END = 0x00,
+  IMG_PAIRS = 0x01,
+  IMG_TDI = 0x02,
+  IMG_PAD = 0x03,
+  IMG_CHECK = 0x04,
+  IMG_BITS = 0x05,
+  IMG_DELAY = 0x06,
+};
+
+// The Pico only yields between ops, keep each one to a few milliseconds
+#define OP_MAX_BYTES 1024
+#define PAD_MIN_BYTES 16
+#define PAD_MAX_BYTES 4096
+
+struct image {
+  struct svf_sink sink;
+  uint8_t *data;
+  size_t len, size;
+};
+
+static uint8_t *reserve(struct image *img, size_t n) {
+  uint8_t *p;
+
+  if (img->len + n > img->size) {
+    size_t size = img->size ? img->size : 65536;
+    while (size < img->len + n)
+      size *= 2;
+    p = realloc(img->data, size);
+    if (!p)
+      return NULL;
+    img->data = p;
+    img->size = size;
+  }
+  p = &img->data[img->len];
+  img->len += n;
+  return p;
+}
+
+static void put_u16(uint8_t *p, uint32_t v) {
+  p[0] = v;
+  p[1] = v >> 8;
+}
+
+static void put_u32(uint8_t *p, uint32_t v) {
+  put_u16(p, v);
+  put_u16(p + 2, v >> 16);
+}
+
+static int constant(uint8_t v) {
+  return v == 0x00 || v == 0xFF;
+}
+
+// Length of the unchecked constant run at byte i, capped at `max`
+static uint32_t pad_run(const uint8_t *tms, const uint8_t *tdi, const uint8_t *mask, uint32_t i, uint32_t n,
+                        uint32_t max) {
+  uint32_t j = i;
+
+  if (!constant(tms[i]) || !constant(tdi[i]))
+    return 0;
+  while (j < n && j - i < max && tms[j] == tms[i] && tdi[j] == tdi[i] && !(mask && mask[j]))
+    j++;
+  return j - i;
+}
+
+static int image_shift(struct svf_sink *sink, uint32_t bits, const uint8_t *tms, const uint8_t *tdi,
+                       const uint8_t *exp, const uint8_t *mask) {
+  struct image *img = (struct image *)sink;
+  uint32_t n = bits / 8;
+  uint32_t i = 0, j, run;
+  uint8_t *p;
+
+  while (i < n) {
+    if (mask && mask[i]) {
+      for (j = i; j < n && j - i < OP_MAX_BYTES && mask[j]; j++)
+        ;
+      p = reserve(img, 3 + (j - i) * 4);
+      if (!p)
+        return -1;
+      p[0] = IMG_CHECK;
+      put_u16(&p[1], j - i);
+      for (p += 3; i < j; i++, p += 4) {
+        p[0] = tms[i];
+        p[1] = tdi[i];
+        p[2] = exp[i];
+        p[3] = mask[i];
+      }
+    } else if ((run = pad_run(tms, tdi, mask, i, n, PAD_MAX_BYTES)) >= PAD_MIN_BYTES) {
+      p = reserve(img, 7);
+      if (!p)
+        return -1;
+      p[0] = IMG_PAD;
+      put_u32(&p[1], run);
+      p[5] = tms[i] != 0;
+      p[6] = tdi[i] != 0;
+      i += run;
+    } else {
+      // Data up to the next check or pad run, or a change of TMS
+      int tdi_only = tms[i] == 0;
+      for (j = i + 1; j < n && j - i < OP_MAX_BYTES; j++) {
+        if ((mask && mask[j]) || (tms[j] == 0) != tdi_only ||
+            pad_run(tms, tdi, mask, j, n, PAD_MIN_BYTES) == PAD_MIN_BYTES)
+          break;
+      }
+      p = reserve(img, 3 + (j - i) * (tdi_only ? 1 : 2));
+      if (!p)
+        return -1;
+      p[0] = tdi_only ? IMG_TDI : IMG_PAIRS;
+      put_u16(&p[1], j - i);
+      for (p += 3; i < j; i++) {
+        if (!tdi_only)
+          *p++ = tms[i];
+        *p++ = tdi[i];
+      }
+    }
+  }
+
+  if (bits % 8) {
+    p = reserve(img, 6);
+    if (!p)
+      return -1;
+    p[0] = IMG_BITS;
+    p[1] = bits % 8;
+    p[2] = tms[n];
+    p[3] = tdi[n];
+    p[4] = mask ? exp[n] : 0;
+    p[5] = mask ? mask[n] : 0;
+  }
+  return 0;
+}
+
+static int image_delay(struct svf_sink *sink, uint64_t us) {
+  struct image *img = (struct image *)sink;
+
+  while (us) {
+    uint32_t n = us > UINT32_MAX / 2 ? UINT32_MAX / 2 : us;  // the Pico compares times as int32
+    uint8_t *p = reserve(img, 5);
+    if (!p)
+      return -1;
+    p[0] = IMG_DELAY;
+    put_u32(&p[1], n);
+    us -= n;
+  }
+  return 0;
+}
+
+// FNV-1a, as in firmware/store.c
+static uint64_t image_hash(const uint8_t *data, size_t len) {
+  uint64_t h = 0xcbf29ce484222325ull;
+
+  for (size_t i = 0; i < len; i++) {
+    h ^= data[i];
+    h *= 0x100000001b3ull;
+  }
+  return h;
+}
+
+int store_file(const char *path, int flags) {
+  struct image img = { .sink = { image_shift, image_delay } };
+  struct pico_store_info info;
+  uint64_t hash;
+  uint8_t *end;
+  int ret = -1;
+
+  if (pico_store_info(&info))
+    return -1;
+  if (svf_compile(path, &img.sink))
+    goto out;
+  end = reserve(&img, 1);
+  if (!end)
+    goto out;
+  *end = IMG_END;
+
+  hash = image_hash(img.data, img.len);
+  printf("store: %s compiled to %zu bytes, %u bytes free\n", path, img.len, info.capacity);
+  if (img.len > info.capacity) {
+    fprintf(stderr, "store: the image does not fit\n");
+    goto out;
+  }
+  if (info.valid && info.hash == hash && info.size == img.len && info.flags == flags) {
+    printf("store: the Pico already holds this image\n");
+    ret = 0;
+    goto out;
+  }
+
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  ret = pico_store(img.data, img.len, hash, flags);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  if (!ret)
+    printf("store: written in %.2f s%s\n", (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9,
+           flags & STORE_AUTORUN ? ", played at every power-up" : "");
+
+out:
+  free(img.data);
+  return ret;
+}
+
+int store_replay(void) {
+  struct timespec t0, t1;
+  uint32_t bit;
+  int ret;
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  ret = pico_replay(&bit);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  if (ret < 0)
+    return -1;
+  if (ret == 2) {
+    printf("replay: bad image, unknown operation after bit %u (corrupt, or made for other firmware)\n", bit);
+    return -1;
+  }
+  if (ret) {
+    printf("replay: TDO mismatch at bit %u\n", bit);
+    return 1;
+  }
+  printf("replay: done in %.2f s\n", (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9);
+  return 0;
+}
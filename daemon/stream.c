@@ -0,0 +1,129 @@
+/*
+   PMOD stream (see firmware/stream.h) to a file, a pipe or a TCP client.
+
+   The data is written out as it arrives, there are no requests per transfer.
+   Ctrl-C stops the stream. With ":port" the daemon waits for one client
+   and streams until the client goes away.
+*/
+
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "xvcpico.h"
+
+static volatile int stop;
+static int out_fd = -1;
+
+struct stream_out {
+  int fd;
+  uint64_t bytes;
+  int hung_up;  // the reader went away, the normal end of a TCP stream
+};
+
+static void stream_signal(int sig) {
+  (void)sig;
+  stop = 1;
+}
+
+static int stream_sink(const uint8_t *data, int len, void *user) {
+  struct stream_out *out = user;
+
+  while (len) {
+    ssize_t n = write(out->fd, data, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0) {
+      if (n < 0 && (errno == EPIPE || errno == ECONNRESET))
+        out->hung_up = 1;
+      else if (!stop)
+        perror("stream: write");
+      return -1;
+    }
+    data += n;
+    len -= n;
+    out->bytes += n;
+  }
+  return 0;
+}
+
+// Wait for one client on `port`
+static int accept_client(int port) {
+  struct sockaddr_in address = { .sin_family = AF_INET, .sin_addr.s_addr = INADDR_ANY, .sin_port = htons(port) };
+  int s, fd, on = 1;
+
+  s = socket(AF_INET, SOCK_STREAM, 0);
+  if (s < 0) {
+    perror("socket");
+    return -1;
+  }
+  setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  if (bind(s, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(s, 0) < 0) {
+    perror("bind");
+    close(s);
+    return -1;
+  }
+  fprintf(stderr, "stream: waiting for a client on port %d\n", port);
+  fd = accept(s, NULL, NULL);
+  if (fd < 0 && !stop)
+    perror("accept");
+  close(s);
+  return fd;
+}
+
+int stream_open(const char *dest) {
+  if (strcmp(dest, "-") == 0) {
+    // stdout carries the data, everything printed goes to stderr instead
+    out_fd = dup(STDOUT_FILENO);
+    if (out_fd < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+      perror("stream: stdout");
+      return -1;
+    }
+  } else if (dest[0] != ':' && (out_fd = open(dest, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+    perror(dest);
+    return -1;
+  }
+  return 0;
+}
+
+int stream_run(const char *dest, unsigned khz) {
+  struct stream_out out = { .fd = out_fd };
+  struct pico_stream_status status = { 0 };
+  struct sigaction sa;
+  struct timespec t0, t1;
+  double t;
+  int ret;
+
+  // No SA_RESTART, so Ctrl-C also gets accept() and write() out of the way
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = stream_signal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  if (dest[0] == ':')
+    out.fd = accept_client(atoi(dest + 1));
+  if (out.fd < 0)
+    return -1;
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  ret = pico_stream(khz, stream_sink, &out, &stop, &status);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  t = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+  close(out.fd);
+
+  fprintf(stderr, "stream: %llu bytes in %.1f s (%.0f KB/s), PCK %u kHz", (unsigned long long)out.bytes, t,
+          out.bytes / t / 1e3, status.khz);
+  if (status.stalls)
+    fprintf(stderr, ", the host fell behind %u times", status.stalls);
+  fprintf(stderr, "\n");
+  return ret && !out.hung_up ? -1 : 0;
+}
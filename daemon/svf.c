@@ -0,0 +1,858 @@
+/*
+   SVF/XSVF player: plays a file straight into the Pico's shift path, without
+   an XVC client and socket in between.
+
+   The file is mmap()ed and parsed one statement (SVF) or command (XSVF) at a
+   time. The TMS/TDI bits of consecutive operations are queued into one large
+   batch, together with the expected TDO and its mask, and clocked out with a
+   single xvc_shift() whenever the batch is full, a delay has to be honoured,
+   or a result is needed. Batches that carry expected TDO go out with
+   xvc_verify() instead, so the compare happens on the Pico and only a
+   pass/fail status comes back. svf_compile() hands the same batches and
+   delays to a sink instead, which is how store.c builds flash images.
+*/
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "tap.h"
+#include "xvcpico.h"
+
+#define BATCH_BYTES (64 * 1024)
+#define BATCH_BITS (BATCH_BYTES * 8)
+
+// Start of a checked scan (or of its continuation) within the batch, used to
+// point at the offending statement when TDO does not match.
+struct svf_mark {
+  uint32_t bit;
+  uint32_t scan_bit;
+  int line;
+};
+
+static struct {
+  uint8_t tms[BATCH_BYTES];
+  uint8_t tdi[BATCH_BYTES];
+  uint8_t tdo[BATCH_BYTES];
+  uint8_t exp[BATCH_BYTES];
+  uint8_t mask[BATCH_BYTES];
+  uint32_t bits;
+  int checked;
+  struct svf_mark *marks;
+  size_t nmarks, marks_size;
+} batch;
+
+static enum tap_state state;  // after the queued bits
+static int line;              // SVF line / XSVF command offset being played
+static uint64_t total_bits;
+static unsigned long total_checks;
+
+// Set by batch_flush() on a TDO mismatch
+static int fail_line;
+static uint32_t fail_bit;
+
+// Batches and delays go here instead of to the Pico, see svf_compile()
+static struct svf_sink *sink;
+
+static inline int get_bit(const uint8_t *v, uint32_t i) {
+  return (v[i / 8] >> (i % 8)) & 1;
+}
+
+static inline void set_bit(uint8_t *v, uint32_t i) {
+  v[i / 8] |= 1 << (i % 8);
+}
+
+// Clock out the batch. Returns 1 on a TDO mismatch, -1 on errors, 0 otherwise.
+static int batch_flush() {
+  uint32_t nbytes = (batch.bits + 7) / 8;
+  int ret = 0;
+
+  if (!batch.bits)
+    return 0;
+
+  if (sink) {
+    ret = sink->shift(sink, batch.bits, batch.tms, batch.tdi, batch.checked ? batch.exp : NULL,
+                      batch.checked ? batch.mask : NULL) ? -1 : 0;
+  } else if (batch.checked) {
+    // Checked batches are compared on the Pico, only the outcome comes back
+    uint32_t bit;
+    total_checks++;
+    ret = xvc_verify(batch.bits, batch.tms, batch.tdi, batch.exp, batch.mask, &bit);
+    if (ret > 0) {
+      size_t m = 0;
+      while (m + 1 < batch.nmarks && batch.marks[m + 1].bit <= bit)
+        m++;
+      fail_line = batch.marks[m].line;
+      fail_bit = bit - batch.marks[m].bit + batch.marks[m].scan_bit;
+      ret = 1;
+    }
+  } else {
+    ret = xvc_shift(batch.bits, batch.tms, batch.tdi, batch.tdo, NULL);
+  }
+  total_bits += batch.bits;
+
+  memset(batch.tms, 0, nbytes);
+  memset(batch.tdi, 0, nbytes);
+  memset(batch.exp, 0, nbytes);
+  memset(batch.mask, 0, nbytes);
+  batch.bits = 0;
+  batch.checked = 0;
+  batch.nmarks = 0;
+  return ret;
+}
+
+static int add_mark(uint32_t scan_bit) {
+  if (batch.nmarks == batch.marks_size) {
+    size_t size = batch.marks_size ? batch.marks_size * 2 : 64;
+    struct svf_mark *marks = realloc(batch.marks, size * sizeof(*marks));
+    if (!marks)
+      return -1;
+    batch.marks = marks;
+    batch.marks_size = size;
+  }
+  batch.marks[batch.nmarks].bit = batch.bits;
+  batch.marks[batch.nmarks].scan_bit = scan_bit;
+  batch.marks[batch.nmarks].line = line;
+  batch.nmarks++;
+  return 0;
+}
+
+// Queue `n` TMS bits (LSB first) with TDI low
+static int queue_tms(uint32_t tms, int n) {
+  int ret;
+
+  for (int i = 0; i < n; i++) {
+    if (batch.bits == BATCH_BITS && (ret = batch_flush()))
+      return ret;
+    if ((tms >> i) & 1)
+      set_bit(batch.tms, batch.bits);
+    state = tap_next(state, (tms >> i) & 1);
+    batch.bits++;
+  }
+  return 0;
+}
+
+static int goto_state(enum tap_state to) {
+  uint32_t tms;
+  int n = tap_path(state, to, &tms);
+  int ret;
+
+  if ((ret = queue_tms(tms, n)))
+    return ret;
+  state = to;
+  return 0;
+}
+
+// Queue `n` TMS=0 clocks (TMS=1 in Test-Logic-Reset, to stay there)
+static int queue_clocks(uint64_t n) {
+  int tms = state == TAP_RESET;
+  int ret;
+
+  while (n--) {
+    if (batch.bits == BATCH_BITS && (ret = batch_flush()))
+      return ret;
+    if (tms)
+      set_bit(batch.tms, batch.bits);
+    batch.bits++;
+  }
+  return 0;
+}
+
+// Queue scan bits from LSB first bit vectors, the TAP must be in a shift
+// state. exp == NULL means no check, mask == NULL checks every bit. With
+// `last` the final bit leaves the shift state.
+static int queue_scan(const uint8_t *tdi, const uint8_t *exp, const uint8_t *mask, uint32_t n, uint32_t scan_bit, int last) {
+  int ret;
+
+  for (uint32_t i = 0; i < n; i++) {
+    if (batch.bits == BATCH_BITS && (ret = batch_flush()))
+      return ret;
+    if (exp && (i == 0 || batch.bits == 0) && add_mark(scan_bit + i))
+      return -1;
+    if (tdi && get_bit(tdi, i))
+      set_bit(batch.tdi, batch.bits);
+    if (exp && (!mask || get_bit(mask, i))) {
+      set_bit(batch.mask, batch.bits);
+      if (get_bit(exp, i))
+        set_bit(batch.exp, batch.bits);
+      batch.checked = 1;
+    }
+    if (last && i == n - 1) {
+      set_bit(batch.tms, batch.bits);
+      state = tap_next(state, 1);
+    }
+    batch.bits++;
+  }
+  return 0;
+}
+
+static void wait_us(uint64_t us) {
+  struct timespec ts = { us / 1000000, (us % 1000000) * 1000 };
+
+  if (sink) {
+    sink->delay(sink, us);
+    return;
+  }
+  nanosleep(&ts, NULL);
+}
+
+//--------------------------------------------------------------------+
+// SVF
+//--------------------------------------------------------------------+
+
+struct svf_field {
+  uint32_t len;
+  uint8_t *tdi, *tdo, *mask, *smask;
+  int has_tdo;
+};
+
+static struct svf_field sir, sdr, hir, hdr, tir, tdr;
+static enum tap_state endir = TAP_IDLE, enddr = TAP_IDLE;
+static enum tap_state run_state = TAP_IDLE, run_end = TAP_IDLE;
+
+static const char *svf_pos, *svf_end;
+static int svf_line;
+
+struct svf_token {
+  const char *s;
+  size_t n;
+};
+
+#define SVF_MAX_TOKENS 32
+
+static void svf_skip_space() {
+  while (svf_pos < svf_end) {
+    if (*svf_pos == '\n') {
+      svf_line++;
+      svf_pos++;
+    } else if (isspace((unsigned char)*svf_pos)) {
+      svf_pos++;
+    } else if (*svf_pos == '!' || (*svf_pos == '/' && svf_pos + 1 < svf_end && svf_pos[1] == '/')) {
+      while (svf_pos < svf_end && *svf_pos != '\n')
+        svf_pos++;
+    } else {
+      break;
+    }
+  }
+}
+
+// Split the next statement into tokens. A parenthesized value is a single
+// token that still points into the mapped file. Returns the number of
+// tokens, 0 at the end of the file and -1 on a syntax error.
+static int svf_statement(struct svf_token *tok) {
+  int n = 0;
+
+  svf_skip_space();
+  if (svf_pos >= svf_end)
+    return 0;
+  line = svf_line;
+
+  while (1) {
+    svf_skip_space();
+    if (svf_pos >= svf_end) {
+      fprintf(stderr, "svf: line %d: missing ';'\n", line);
+      return -1;
+    }
+    if (*svf_pos == ';') {
+      svf_pos++;
+      return n;
+    }
+    if (n == SVF_MAX_TOKENS) {
+      fprintf(stderr, "svf: line %d: statement too long\n", line);
+      return -1;
+    }
+    tok[n].s = svf_pos;
+    if (*svf_pos == '(') {
+      while (svf_pos < svf_end && *svf_pos != ')') {
+        if (*svf_pos == '\n')
+          svf_line++;
+        svf_pos++;
+      }
+      if (svf_pos >= svf_end) {
+        fprintf(stderr, "svf: line %d: missing ')'\n", line);
+        return -1;
+      }
+      svf_pos++;
+    } else {
+      while (svf_pos < svf_end && !isspace((unsigned char)*svf_pos) && *svf_pos != ';' && *svf_pos != '(')
+        svf_pos++;
+    }
+    tok[n].n = svf_pos - tok[n].s;
+    n++;
+  }
+}
+
+static int tok_is(const struct svf_token *tok, const char *word) {
+  return tok->n == strlen(word) && strncasecmp(tok->s, word, tok->n) == 0;
+}
+
+static double tok_number(const struct svf_token *tok) {
+  char buf[64];
+  size_t n = tok->n < sizeof(buf) - 1 ? tok->n : sizeof(buf) - 1;
+
+  memcpy(buf, tok->s, n);
+  buf[n] = 0;
+  return strtod(buf, NULL);
+}
+
+static int tok_state(const struct svf_token *tok) {
+  char buf[16];
+
+  if (tok->n >= sizeof(buf))
+    return -1;
+  memcpy(buf, tok->s, tok->n);
+  buf[tok->n] = 0;
+  return tap_lookup(buf);
+}
+
+// Decode a "(hex)" token into an LSB first bit vector of `bits` bits. The
+// rightmost digit holds bit 0.
+static int svf_hex(const struct svf_token *tok, uint8_t *v, uint32_t bits) {
+  uint32_t bit = 0;
+
+  memset(v, 0, (bits + 7) / 8);
+  for (const char *c = tok->s + tok->n - 2; c > tok->s; c--) {
+    int d;
+    if (isspace((unsigned char)*c))
+      continue;
+    if (!isxdigit((unsigned char)*c)) {
+      fprintf(stderr, "svf: line %d: bad hex digit '%c'\n", line, *c);
+      return -1;
+    }
+    d = isdigit((unsigned char)*c) ? *c - '0' : (tolower((unsigned char)*c) - 'a' + 10);
+    for (int i = 0; i < 4; i++, bit++) {
+      if (bit < bits && ((d >> i) & 1))
+        set_bit(v, bit);
+    }
+  }
+  return 0;
+}
+
+// SIR/SDR/HIR/HDR/TIR/TDR <length> [TDI (..)] [TDO (..)] [MASK (..)] [SMASK (..)]
+static int svf_parse_field(struct svf_field *f, struct svf_token *tok, int n) {
+  uint32_t len;
+
+  if (n < 2) {
+    fprintf(stderr, "svf: line %d: missing length\n", line);
+    return -1;
+  }
+  len = (uint32_t)tok_number(&tok[1]);
+  if (len != f->len || !f->tdi) {
+    size_t bytes = (len + 7) / 8 + 1;
+    free(f->tdi);
+    free(f->tdo);
+    free(f->mask);
+    free(f->smask);
+    f->tdi = calloc(bytes, 1);
+    f->tdo = calloc(bytes, 1);
+    f->mask = malloc(bytes);
+    f->smask = malloc(bytes);
+    if (!f->tdi || !f->tdo || !f->mask || !f->smask) {
+      fprintf(stderr, "svf: line %d: out of memory\n", line);
+      return -1;
+    }
+    memset(f->mask, 0xff, bytes);
+    memset(f->smask, 0xff, bytes);
+    f->len = len;
+  }
+  f->has_tdo = 0;
+
+  for (int i = 2; i < n; i += 2) {
+    uint8_t *v;
+    if (i + 1 >= n || tok[i + 1].s[0] != '(') {
+      fprintf(stderr, "svf: line %d: expected a value after '%.*s'\n", line, (int)tok[i].n, tok[i].s);
+      return -1;
+    }
+    if (tok_is(&tok[i], "TDI")) {
+      v = f->tdi;
+    } else if (tok_is(&tok[i], "TDO")) {
+      v = f->tdo;
+      f->has_tdo = 1;
+    } else if (tok_is(&tok[i], "MASK")) {
+      v = f->mask;
+    } else if (tok_is(&tok[i], "SMASK")) {
+      v = f->smask;
+    } else {
+      fprintf(stderr, "svf: line %d: unknown keyword '%.*s'\n", line, (int)tok[i].n, tok[i].s);
+      return -1;
+    }
+    if (svf_hex(&tok[i + 1], v, len))
+      return -1;
+  }
+  return 0;
+}
+
+// Header, body and trailer go out in one scan, header bits first
+static int svf_scan(int ir, struct svf_field *head, struct svf_field *body, struct svf_field *tail) {
+  struct svf_field *part[3] = { head, body, tail };
+  uint32_t total = head->len + body->len + tail->len;
+  uint32_t scan_bit = 0;
+  int ret;
+
+  if (total == 0)
+    return 0;
+  if ((ret = goto_state(ir ? TAP_IRSHIFT : TAP_DRSHIFT)))
+    return ret;
+  for (int p = 0; p < 3; p++) {
+    struct svf_field *f = part[p];
+    if (!f->len)
+      continue;
+    if ((ret = queue_scan(f->tdi, f->has_tdo ? f->tdo : NULL, f->mask, f->len, scan_bit, scan_bit + f->len == total)))
+      return ret;
+    scan_bit += f->len;
+  }
+  return goto_state(ir ? endir : enddr);
+}
+
+// RUNTEST [run_state] [run_count TCK|SCK] [min_time SEC] [MAXIMUM max_time SEC] [ENDSTATE end_state]
+static int svf_runtest(struct svf_token *tok, int n) {
+  uint64_t count = 0;
+  double min_time = 0;
+  int i = 1, s, ret;
+
+  if (i < n && (s = tok_state(&tok[i])) >= 0) {
+    run_state = run_end = s;
+    i++;
+  }
+  while (i + 1 < n) {
+    if (tok_is(&tok[i + 1], "TCK") || tok_is(&tok[i + 1], "SCK")) {
+      count = (uint64_t)tok_number(&tok[i]);
+      i += 2;
+    } else if (tok_is(&tok[i + 1], "SEC")) {
+      min_time = tok_number(&tok[i]);
+      i += 2;
+    } else if (tok_is(&tok[i], "MAXIMUM")) {
+      i += 3;
+    } else if (tok_is(&tok[i], "ENDSTATE") && (s = tok_state(&tok[i + 1])) >= 0) {
+      run_end = s;
+      i += 2;
+    } else {
+      break;
+    }
+  }
+  if (i != n) {
+    fprintf(stderr, "svf: line %d: bad RUNTEST\n", line);
+    return -1;
+  }
+
+  if ((ret = goto_state(run_state)) || (ret = queue_clocks(count)))
+    return ret;
+  if (min_time > 0) {
+    if ((ret = batch_flush()))
+      return ret;
+    wait_us((uint64_t)(min_time * 1e6));
+  }
+  return goto_state(run_end);
+}
+
+static int svf_stable_state(struct svf_token *tok, enum tap_state *s) {
+  int v = tok_state(tok);
+  if (v != TAP_RESET && v != TAP_IDLE && v != TAP_DRPAUSE && v != TAP_IRPAUSE) {
+    fprintf(stderr, "svf: line %d: '%.*s' is not a stable state\n", line, (int)tok->n, tok->s);
+    return -1;
+  }
+  *s = v;
+  return 0;
+}
+
+static int play_svf(const char *data, size_t size) {
+  struct svf_token tok[SVF_MAX_TOKENS];
+  int n, ret = 0;
+
+  svf_pos = data;
+  svf_end = data + size;
+  svf_line = 1;
+
+  while (ret == 0 && (n = svf_statement(tok)) > 0) {
+    if (tok_is(&tok[0], "SIR")) {
+      ret = svf_parse_field(&sir, tok, n);
+      if (!ret)
+        ret = svf_scan(1, &hir, &sir, &tir);
+    } else if (tok_is(&tok[0], "SDR")) {
+      ret = svf_parse_field(&sdr, tok, n);
+      if (!ret)
+        ret = svf_scan(0, &hdr, &sdr, &tdr);
+    } else if (tok_is(&tok[0], "HIR")) {
+      ret = svf_parse_field(&hir, tok, n);
+    } else if (tok_is(&tok[0], "HDR")) {
+      ret = svf_parse_field(&hdr, tok, n);
+    } else if (tok_is(&tok[0], "TIR")) {
+      ret = svf_parse_field(&tir, tok, n);
+    } else if (tok_is(&tok[0], "TDR")) {
+      ret = svf_parse_field(&tdr, tok, n);
+    } else if (tok_is(&tok[0], "RUNTEST")) {
+      ret = svf_runtest(tok, n);
+    } else if (tok_is(&tok[0], "STATE")) {
+      for (int i = 1; ret == 0 && i < n; i++) {
+        int s = tok_state(&tok[i]);
+        if (s < 0) {
+          fprintf(stderr, "svf: line %d: unknown state '%.*s'\n", line, (int)tok[i].n, tok[i].s);
+          ret = -1;
+        } else {
+          ret = goto_state(s);
+        }
+      }
+    } else if (tok_is(&tok[0], "ENDIR") && n == 2) {
+      ret = svf_stable_state(&tok[1], &endir);
+    } else if (tok_is(&tok[0], "ENDDR") && n == 2) {
+      ret = svf_stable_state(&tok[1], &enddr);
+    } else if (tok_is(&tok[0], "FREQUENCY")) {
+      // TCK runs at whatever rate the firmware shifts at
+    } else if (tok_is(&tok[0], "TRST")) {
+      if (n > 1 && tok_is(&tok[1], "ON"))
+        fprintf(stderr, "svf: line %d: no TRST pin, ignoring TRST ON\n", line);
+    } else {
+      fprintf(stderr, "svf: line %d: unsupported statement '%.*s'\n", line, (int)tok[0].n, tok[0].s);
+      ret = -1;
+    }
+  }
+  if (n < 0)
+    ret = -1;
+  if (ret == 0)
+    ret = batch_flush();
+  if (ret == 1)
+    fprintf(stderr, "svf: line %d: TDO mismatch at bit %u\n", fail_line, fail_bit);
+  return ret;
+}
+
+//--------------------------------------------------------------------+
+// XSVF
+//--------------------------------------------------------------------+
+
+enum xsvf_cmd {
+  XCOMPLETE = 0x00,
+  XTDOMASK = 0x01,
+  XSIR = 0x02,
+  XSDR = 0x03,
+  XRUNTEST = 0x04,
+  XREPEAT = 0x07,
+  XSDRSIZE = 0x08,
+  XSDRTDO = 0x09,
+  XSETSDRMASKS = 0x0A,
+  XSDRINC = 0x0B,
+  XSDRB = 0x0C,
+  XSDRC = 0x0D,
+  XSDRE = 0x0E,
+  XSDRTDOB = 0x0F,
+  XSDRTDOC = 0x10,
+  XSDRTDOE = 0x11,
+  XSTATE = 0x12,
+  XENDIR = 0x13,
+  XENDDR = 0x14,
+  XSIR2 = 0x15,
+  XCOMMENT = 0x16,
+  XWAIT = 0x17,
+};
+
+static const uint8_t *xsvf_pos, *xsvf_end;
+
+static int xsvf_need(size_t n) {
+  if ((size_t)(xsvf_end - xsvf_pos) < n) {
+    fprintf(stderr, "xsvf: offset %d: truncated command\n", line);
+    return -1;
+  }
+  return 0;
+}
+
+static uint32_t xsvf_int(int bytes) {
+  uint32_t v = 0;
+  while (bytes--)
+    v = v << 8 | *xsvf_pos++;
+  return v;
+}
+
+// Values are stored MSB first, convert to an LSB first bit vector
+static int xsvf_value(uint8_t *v, uint32_t bits) {
+  uint32_t bytes = (bits + 7) / 8;
+
+  if (xsvf_need(bytes))
+    return -1;
+  for (uint32_t i = 0; i < bytes; i++)
+    v[i] = xsvf_pos[bytes - 1 - i];
+  xsvf_pos += bytes;
+  return 0;
+}
+
+static int play_xsvf(const uint8_t *data, size_t size) {
+  uint8_t *tdi = NULL, *tdo = NULL, *mask = NULL;
+  uint32_t sdrsize = 0, runtest = 0;
+  int repeat = 32;
+  enum tap_state x_enddr = TAP_IDLE, x_endir = TAP_IDLE;
+  int ret = 0;
+
+  xsvf_pos = data;
+  xsvf_end = data + size;
+
+  while (ret == 0 && xsvf_pos < xsvf_end) {
+    uint8_t cmd = *xsvf_pos++;
+    line = xsvf_pos - data - 1;
+
+    switch (cmd) {
+      case XCOMPLETE:
+        xsvf_pos = xsvf_end;
+        break;
+
+      case XTDOMASK:
+        ret = xsvf_value(mask, sdrsize);
+        break;
+
+      case XSIR:
+      case XSIR2: {
+        uint8_t ir[65536 / 8];
+        uint32_t len;
+        if (xsvf_need(cmd == XSIR ? 1 : 2)) {
+          ret = -1;
+          break;
+        }
+        len = xsvf_int(cmd == XSIR ? 1 : 2);
+        if (len > sizeof(ir) * 8) {
+          fprintf(stderr, "xsvf: offset %d: IR too long\n", line);
+          ret = -1;
+          break;
+        }
+        ret = xsvf_value(ir, len);
+        if (!ret && len) {
+          ret = goto_state(TAP_IRSHIFT);
+          if (!ret)
+            ret = queue_scan(ir, NULL, NULL, len, 0, 1);
+          if (!ret)
+            ret = goto_state(x_endir);
+        }
+        if (!ret && runtest) {
+          if (!(ret = goto_state(TAP_IDLE)))
+            ret = batch_flush();
+          wait_us(runtest);
+        }
+        break;
+      }
+
+      case XSDR:
+      case XSDRTDO:
+      case XSDRB:
+      case XSDRC:
+      case XSDRE:
+      case XSDRTDOB:
+      case XSDRTDOC:
+      case XSDRTDOE: {
+        int check = cmd == XSDR || cmd == XSDRTDO || cmd >= XSDRTDOB;
+        int enter = cmd == XSDR || cmd == XSDRTDO || cmd == XSDRB || cmd == XSDRTDOB;
+        int leave = cmd == XSDR || cmd == XSDRTDO || cmd == XSDRE || cmd == XSDRTDOE;
+        if (xsvf_value(tdi, sdrsize) || (cmd != XSDR && check && xsvf_value(tdo, sdrsize))) {
+          ret = -1;
+          break;
+        }
+        // Only complete scans are retried, see XREPEAT
+        for (int attempt = 0;; attempt++) {
+          if (enter && (ret = goto_state(TAP_DRSHIFT)))
+            break;
+          ret = queue_scan(tdi, check ? tdo : NULL, mask, sdrsize, 0, leave);
+          if (!ret && leave)
+            ret = goto_state(x_enddr);
+          if (!ret && check)
+            ret = batch_flush();
+          if (ret != 1 || !enter || !leave || attempt >= repeat)
+            break;
+          // Mismatch: give the device time and shift again
+          if ((ret = goto_state(TAP_IDLE)) || (ret = queue_clocks(runtest)) || (ret = batch_flush()))
+            break;
+          wait_us(runtest);
+        }
+        if (!ret && leave && runtest) {
+          if (!(ret = goto_state(TAP_IDLE)))
+            ret = batch_flush();
+          wait_us(runtest);
+        }
+        break;
+      }
+
+      case XRUNTEST:
+        if (xsvf_need(4)) {
+          ret = -1;
+          break;
+        }
+        runtest = xsvf_int(4);
+        break;
+
+      case XREPEAT:
+        if (xsvf_need(1)) {
+          ret = -1;
+          break;
+        }
+        repeat = xsvf_int(1);
+        break;
+
+      case XSDRSIZE: {
+        size_t bytes;
+        if (xsvf_need(4)) {
+          ret = -1;
+          break;
+        }
+        sdrsize = xsvf_int(4);
+        bytes = (sdrsize + 7) / 8 + 1;
+        free(tdi);
+        free(tdo);
+        free(mask);
+        tdi = calloc(bytes, 1);
+        tdo = calloc(bytes, 1);
+        mask = malloc(bytes);
+        if (!tdi || !tdo || !mask) {
+          fprintf(stderr, "xsvf: out of memory\n");
+          ret = -1;
+          break;
+        }
+        memset(mask, 0xff, bytes);
+        break;
+      }
+
+      case XSTATE:
+        if (xsvf_need(1)) {
+          ret = -1;
+          break;
+        }
+        ret = goto_state(xsvf_int(1) & 0xF);
+        break;
+
+      case XENDIR:
+      case XENDDR:
+        if (xsvf_need(1)) {
+          ret = -1;
+          break;
+        }
+        if (cmd == XENDIR)
+          x_endir = xsvf_int(1) ? TAP_IRPAUSE : TAP_IDLE;
+        else
+          x_enddr = xsvf_int(1) ? TAP_DRPAUSE : TAP_IDLE;
+        break;
+
+      case XCOMMENT:
+        while (xsvf_pos < xsvf_end && *xsvf_pos++)
+          ;
+        break;
+
+      case XWAIT: {
+        uint8_t wait_state, end_state;
+        if (xsvf_need(6)) {
+          ret = -1;
+          break;
+        }
+        wait_state = xsvf_int(1) & 0xF;
+        end_state = xsvf_int(1) & 0xF;
+        uint32_t us = xsvf_int(4);
+        if (!(ret = goto_state(wait_state)))
+          ret = batch_flush();
+        if (!ret) {
+          wait_us(us);
+          ret = goto_state(end_state);
+        }
+        break;
+      }
+
+      default:
+        fprintf(stderr, "xsvf: offset %d: unsupported command 0x%02x\n", line, cmd);
+        ret = -1;
+        break;
+    }
+  }
+  if (ret == 0)
+    ret = batch_flush();
+  if (ret == 1)
+    fprintf(stderr, "xsvf: offset %d: TDO mismatch at bit %u\n", fail_line, fail_bit);
+
+  free(tdi);
+  free(tdo);
+  free(mask);
+  return ret;
+}
+
+//--------------------------------------------------------------------+
+
+static int is_xsvf(const char *path, const uint8_t *data, size_t size) {
+  size_t len = strlen(path);
+
+  if (len > 5 && strcasecmp(path + len - 5, ".xsvf") == 0)
+    return 1;
+  if (len > 4 && strcasecmp(path + len - 4, ".svf") == 0)
+    return 0;
+  // SVF is plain text
+  for (size_t i = 0; i < size && i < 256; i++) {
+    if (data[i] < 0x20 && !isspace(data[i]))
+      return 1;
+  }
+  return 0;
+}
+
+static int svf_run(const char *path) {
+  struct timespec start, end;
+  struct stat st;
+  void *data;
+  int fd, ret;
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    perror(path);
+    return -1;
+  }
+  if (fstat(fd, &st) < 0) {
+    perror(path);
+    close(fd);
+    return -1;
+  }
+  if (st.st_size == 0) {
+    close(fd);
+    return 0;
+  }
+  data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    perror("mmap");
+    return -1;
+  }
+  madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  // Start from a known state, whatever the last client left behind
+  state = TAP_RESET;
+  total_bits = 0;
+  total_checks = 0;
+  queue_tms(0x1f, 5);
+
+  if (is_xsvf(path, data, st.st_size))
+    ret = play_xsvf(data, st.st_size);
+  else
+    ret = play_svf(data, st.st_size);
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  munmap(data, st.st_size);
+  free(batch.marks);
+  batch.marks = NULL;
+  batch.nmarks = batch.marks_size = 0;
+
+  double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  fprintf(stderr, "%s: %s, %llu bits in %.3f s (%.3f Mbit/s), %lu TDO checks\n", path,
+          ret ? "FAILED" : sink ? "compiled" : "done", (unsigned long long)total_bits, secs,
+          secs > 0 ? total_bits / secs / 1e6 : 0.0, total_checks);
+  return ret;
+}
+
+int svf_play(const char *path) {
+  sink = NULL;
+  return svf_run(path);
+}
+
+int svf_compile(const char *path, struct svf_sink *to) {
+  int ret;
+
+  sink = to;
+  ret = svf_run(path);
+  sink = NULL;
+  return ret;
+}
@@ -0,0 +1,88 @@
+/*
+   JTAG TAP controller state machine.
+*/
+
+#include <string.h>
+#include <strings.h>
+
+#include "tap.h"
+
+// next state for TMS=0 and TMS=1
+static const uint8_t tap_table[TAP_STATES][2] = {
+  [TAP_RESET] = { TAP_IDLE, TAP_RESET },
+  [TAP_IDLE] = { TAP_IDLE, TAP_DRSELECT },
+  [TAP_DRSELECT] = { TAP_DRCAPTURE, TAP_IRSELECT },
+  [TAP_DRCAPTURE] = { TAP_DRSHIFT, TAP_DREXIT1 },
+  [TAP_DRSHIFT] = { TAP_DRSHIFT, TAP_DREXIT1 },
+  [TAP_DREXIT1] = { TAP_DRPAUSE, TAP_DRUPDATE },
+  [TAP_DRPAUSE] = { TAP_DRPAUSE, TAP_DREXIT2 },
+  [TAP_DREXIT2] = { TAP_DRSHIFT, TAP_DRUPDATE },
+  [TAP_DRUPDATE] = { TAP_IDLE, TAP_DRSELECT },
+  [TAP_IRSELECT] = { TAP_IRCAPTURE, TAP_RESET },
+  [TAP_IRCAPTURE] = { TAP_IRSHIFT, TAP_IREXIT1 },
+  [TAP_IRSHIFT] = { TAP_IRSHIFT, TAP_IREXIT1 },
+  [TAP_IREXIT1] = { TAP_IRPAUSE, TAP_IRUPDATE },
+  [TAP_IRPAUSE] = { TAP_IRPAUSE, TAP_IREXIT2 },
+  [TAP_IREXIT2] = { TAP_IRSHIFT, TAP_IRUPDATE },
+  [TAP_IRUPDATE] = { TAP_IDLE, TAP_DRSELECT },
+};
+
+// SVF names
+static const char *const tap_names[TAP_STATES] = {
+  "RESET", "IDLE",
+  "DRSELECT", "DRCAPTURE", "DRSHIFT", "DREXIT1", "DRPAUSE", "DREXIT2", "DRUPDATE",
+  "IRSELECT", "IRCAPTURE", "IRSHIFT", "IREXIT1", "IRPAUSE", "IREXIT2", "IRUPDATE",
+};
+
+enum tap_state tap_next(enum tap_state state, int tms) {
+  return tap_table[state][tms & 1];
+}
+
+const char *tap_name(enum tap_state state) {
+  return state < TAP_STATES ? tap_names[state] : "UNKNOWN";
+}
+
+int tap_lookup(const char *name) {
+  for (int i = 0; i < TAP_STATES; i++) {
+    if (strcasecmp(name, tap_names[i]) == 0)
+      return i;
+  }
+  return -1;
+}
+
+int tap_path(enum tap_state from, enum tap_state to, uint32_t *tms) {
+  uint8_t prev[TAP_STATES], prev_tms[TAP_STATES], queue[TAP_STATES];
+  int seen = 0, head = 0, tail = 0;
+
+  if (to == TAP_RESET) {
+    *tms = 0x1f;
+    return 5;
+  }
+  *tms = 0;
+  if (from == to)
+    return 0;
+
+  // Breadth first search, the graph is tiny
+  queue[tail++] = from;
+  seen |= 1 << from;
+  while (head < tail) {
+    int s = queue[head++];
+    for (int bit = 0; bit < 2; bit++) {
+      int n = tap_table[s][bit];
+      if (seen & (1 << n))
+        continue;
+      seen |= 1 << n;
+      prev[n] = s;
+      prev_tms[n] = bit;
+      queue[tail++] = n;
+    }
+  }
+
+  int len = 0;
+  uint32_t reversed = 0;
+  for (int s = to; s != (int)from; s = prev[s])
+    reversed |= (uint32_t)prev_tms[s] << len++;
+  for (int i = 0; i < len; i++)
+    *tms |= ((reversed >> (len - 1 - i)) & 1) << i;
+  return len;
+}
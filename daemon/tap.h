@@ -0,0 +1,41 @@
+/*
+   JTAG TAP controller state machine, shared by the SVF/XSVF player and
+   anything else in the daemon that needs to follow or drive TAP states.
+*/
+
+#ifndef TAP_H
+#define TAP_H
+
+#include <stdint.h>
+
+// Numbered like the XSVF XSTATE argument
+enum tap_state {
+  TAP_RESET = 0,
+  TAP_IDLE,
+  TAP_DRSELECT,
+  TAP_DRCAPTURE,
+  TAP_DRSHIFT,
+  TAP_DREXIT1,
+  TAP_DRPAUSE,
+  TAP_DREXIT2,
+  TAP_DRUPDATE,
+  TAP_IRSELECT,
+  TAP_IRCAPTURE,
+  TAP_IRSHIFT,
+  TAP_IREXIT1,
+  TAP_IRPAUSE,
+  TAP_IREXIT2,
+  TAP_IRUPDATE,
+  TAP_STATES,
+};
+
+enum tap_state tap_next(enum tap_state state, int tms);
+const char *tap_name(enum tap_state state);
+int tap_lookup(const char *name);  // SVF state name, -1 if unknown
+
+// Shortest TMS sequence from `from` to `to`, LSB first. Returns the number of
+// bits. Going to TAP_RESET always uses five TMS=1 so it also works from an
+// unknown state.
+int tap_path(enum tap_state from, enum tap_state to, uint32_t *tms);
+
+#endif
@@ -0,0 +1,299 @@
+/*
+   JTAG activity tracer, see trace.h.
+
+   The rings are written by whoever shifts and read by trace_dump(). Records
+   are filled in first and then published by advancing the head with release
+   semantics, and old entries are simply overwritten. A dump does not stop
+   the writer, so SIGUSR1 dumps (trace_poll()) happen on the thread that
+   shifts, between two shifts. The final dump runs once shifting has ended.
+*/
+
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "tap.h"
+#include "trace.h"
+
+#define TRACE_RECORDS (1 << 16)        // records kept
+#define TRACE_DATA (16 * 1024 * 1024)  // bytes of TMS/TDI/TDO kept
+
+int trace_enabled;
+
+static struct trace_rec *records;
+static uint8_t *data;
+static _Atomic uint64_t rec_head, data_head;
+static const char *trace_path;
+static uint64_t trace_start;
+static atomic_int dump_requested;  // set on SIGUSR1, see trace_poll()
+
+// TAP state as seen from the TMS vectors, TAP_STATES until the first reset
+static enum tap_state tap = TAP_STATES;
+static int tap_ones;
+
+static void trace_signal(int sig) {
+  (void)sig;
+  dump_requested = 1;
+}
+
+uint64_t trace_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec - trace_start;
+}
+
+int trace_init(int bits, const char *path) {
+  struct sigaction sa;
+
+  records = calloc(TRACE_RECORDS, sizeof(*records));
+  if (bits)
+    data = malloc(TRACE_DATA);
+  if (!records || (bits && !data)) {
+    fprintf(stderr, "trace: out of memory\n");
+    return -1;
+  }
+  trace_path = path;
+  trace_start = 0;
+  trace_start = trace_now();
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = trace_signal;
+  sa.sa_flags = SA_RESTART;
+  sigaction(SIGUSR1, &sa, NULL);
+
+  trace_enabled = 1;
+  return 0;
+}
+
+static struct trace_rec *rec_next(void) {
+  uint64_t head = atomic_load_explicit(&rec_head, memory_order_relaxed);
+  struct trace_rec *r = &records[head % TRACE_RECORDS];
+  memset(r, 0, sizeof(*r));
+  return r;
+}
+
+static void rec_publish(void) {
+  atomic_fetch_add_explicit(&rec_head, 1, memory_order_release);
+}
+
+static uint64_t data_put(const uint8_t *v, uint32_t bytes) {
+  uint64_t pos = atomic_load_explicit(&data_head, memory_order_relaxed);
+
+  for (uint32_t i = 0; i < bytes; i++)
+    data[(pos + i) % TRACE_DATA] = v ? v[i] : 0;
+  atomic_store_explicit(&data_head, pos + bytes, memory_order_release);
+  return pos;
+}
+
+void trace_shift(int kind, uint32_t len, const uint8_t *tms, const uint8_t *tdi, const uint8_t *tdo, uint64_t t0,
+                 uint64_t t1) {
+  uint32_t bytes = (len + 7) / 8;
+  struct trace_rec *r = rec_next();
+
+  r->type = TRACE_SHIFT;
+  r->kind = kind;
+  r->t0 = t0;
+  r->t1 = t1;
+  r->len = len;
+  r->state = tap;
+  if (data && bytes * 3ull <= TRACE_DATA / 4) {
+    r->flags |= TRACE_F_BITS;
+    r->data = data_put(tms, bytes);
+    data_put(tdi, bytes);
+    data_put(tdo, bytes);
+  }
+  rec_publish();
+
+  // Follow the TAP through the TMS vector. Whole bytes that leave a stable
+  // state alone are skipped, which covers the bulk of any large shift.
+  for (uint32_t i = 0; i < len;) {
+    if ((i & 7) == 0 && i + 8 <= len) {
+      uint8_t b = tms[i / 8];
+      if (b == 0 && (tap == TAP_STATES || tap_next(tap, 0) == tap)) {
+        tap_ones = 0;
+        i += 8;
+        continue;
+      }
+      if (b == 0xff && tap == TAP_RESET) {
+        i += 8;
+        continue;
+      }
+    }
+
+    int t = (tms[i / 8] >> (i % 8)) & 1;
+    enum tap_state next;
+    if (tap == TAP_STATES) {
+      tap_ones = t ? tap_ones + 1 : 0;
+      next = tap_ones >= 5 ? TAP_RESET : TAP_STATES;
+    } else {
+      next = tap_next(tap, t);
+    }
+    i++;
+    if (next != tap) {
+      r = rec_next();
+      r->type = TRACE_STATE;
+      r->t0 = r->t1 = t0 + (t1 - t0) * i / len;
+      r->bit = i;
+      r->state = next;
+      rec_publish();
+      tap = next;
+    }
+  }
+}
+
+//--------------------------------------------------------------------+
+// Dump
+//--------------------------------------------------------------------+
+
+static int get_bit(uint64_t pos, uint32_t bit) {
+  return (data[(pos + bit / 8) % TRACE_DATA] >> (bit % 8)) & 1;
+}
+
+// Timestamps must be increasing, and each is printed once
+static uint64_t vcd_last;
+
+static void vcd_time(FILE *f, uint64_t t) {
+  if (t > vcd_last || vcd_last == ~0ull) {
+    fprintf(f, "#%llu\n", (unsigned long long)t);
+    vcd_last = t;
+  }
+}
+
+static void vcd_bits(FILE *f, const char *id, uint32_t v, int width) {
+  fputc('b', f);
+  for (int i = width - 1; i >= 0; i--)
+    fputc('0' + ((v >> i) & 1), f);
+  fprintf(f, " %s\n", id);
+}
+
+static void vcd_state(FILE *f, int state) {
+  vcd_bits(f, "s", state, 5);
+  fprintf(f, "s%s n\n", state < TAP_STATES ? tap_name(state) : "UNKNOWN");
+}
+
+static void vcd_dump(FILE *f, uint64_t first, uint64_t head, uint64_t dhead) {
+  int last[3] = { -1, -1, -1 };  // tms, tdi, tdo
+
+  fprintf(f, "$comment xvcd-pico trace, times relative to the daemon start $end\n");
+  fprintf(f, "$timescale 1ns $end\n");
+  fprintf(f, "$scope module jtag $end\n");
+  fprintf(f, "$var wire 1 a shift_active $end\n");
+  fprintf(f, "$var wire 32 l shift_len $end\n");
+  fprintf(f, "$var wire 1 v verify $end\n");
+  fprintf(f, "$var wire 5 s tap_state $end\n");
+  fprintf(f, "$var string 1 n tap_state_name $end\n");
+  if (data) {
+    fprintf(f, "$var wire 1 m tms $end\n");
+    fprintf(f, "$var wire 1 i tdi $end\n");
+    fprintf(f, "$var wire 1 o tdo $end\n");
+  }
+  fprintf(f, "$upscope $end\n$enddefinitions $end\n");
+  vcd_last = ~0ull;
+
+  for (uint64_t h = first; h < head; h++) {
+    struct trace_rec *r = &records[h % TRACE_RECORDS];
+    if (r->type != TRACE_SHIFT)
+      continue;
+
+    vcd_time(f, r->t0);
+    fprintf(f, "1a\n");
+    vcd_bits(f, "l", r->len, 32);
+    fprintf(f, "%dv\n", r->kind == TRACE_KIND_VERIFY);
+    if (h == first)
+      vcd_state(f, r->state);
+
+    // The state records of this shift follow it in the ring
+    uint64_t s = h + 1;
+    int bits = data && (r->flags & TRACE_F_BITS) && dhead - r->data <= TRACE_DATA;
+    uint32_t bytes = (r->len + 7) / 8;
+    if (bits) {
+      for (uint32_t b = 0; b < r->len; b++) {
+        uint64_t t = r->t0 + (r->t1 - r->t0) * b / r->len;
+        int v[3] = { get_bit(r->data, b), get_bit(r->data + bytes, b), get_bit(r->data + 2 * bytes, b) };
+        for (int k = 0; k < 3; k++) {
+          if (v[k] == last[k])
+            continue;
+          vcd_time(f, t);
+          fprintf(f, "%d%c\n", v[k], "mio"[k]);
+          last[k] = v[k];
+        }
+        // State reached with the clock of bit b
+        while (s < head && records[s % TRACE_RECORDS].type == TRACE_STATE &&
+               records[s % TRACE_RECORDS].bit <= b + 1) {
+          if (records[s % TRACE_RECORDS].bit == b + 1) {
+            vcd_time(f, records[s % TRACE_RECORDS].t0);
+            vcd_state(f, records[s % TRACE_RECORDS].state);
+          }
+          s++;
+        }
+      }
+    }
+    for (; s < head && records[s % TRACE_RECORDS].type == TRACE_STATE; s++) {
+      vcd_time(f, records[s % TRACE_RECORDS].t0);
+      vcd_state(f, records[s % TRACE_RECORDS].state);
+    }
+    vcd_time(f, r->t1 > r->t0 ? r->t1 : r->t0 + 1);
+    fprintf(f, "0a\n");
+  }
+}
+
+static void bin_dump(FILE *f, uint64_t first, uint64_t head, uint64_t dhead) {
+  uint32_t version = TRACE_VERSION, count = head - first;
+
+  fwrite("XVCTRACE", 8, 1, f);
+  fwrite(&version, 4, 1, f);
+  fwrite(&count, 4, 1, f);
+  for (uint64_t h = first; h < head; h++) {
+    struct trace_rec r = records[h % TRACE_RECORDS];
+    if (r.type == TRACE_SHIFT && (!(r.flags & TRACE_F_BITS) || dhead - r.data > TRACE_DATA))
+      r.flags &= ~TRACE_F_BITS;
+    fwrite(&r, sizeof(r), 1, f);
+  }
+  for (uint64_t h = first; h < head; h++) {
+    struct trace_rec *r = &records[h % TRACE_RECORDS];
+    if (r->type != TRACE_SHIFT || !(r->flags & TRACE_F_BITS) || dhead - r->data > TRACE_DATA)
+      continue;
+    for (uint64_t i = 0; i < 3ull * ((r->len + 7) / 8); i++)
+      fputc(data[(r->data + i) % TRACE_DATA], f);
+  }
+}
+
+int trace_dump(void) {
+  uint64_t head = atomic_load_explicit(&rec_head, memory_order_acquire);
+  uint64_t dhead = atomic_load_explicit(&data_head, memory_order_acquire);
+  uint64_t first = head > TRACE_RECORDS ? head - TRACE_RECORDS : 0;
+  size_t n;
+  FILE *f;
+
+  if (!trace_enabled)
+    return 0;
+  n = strlen(trace_path);
+  // Start at a shift, not in the middle of one's state records
+  while (first < head && records[first % TRACE_RECORDS].type != TRACE_SHIFT)
+    first++;
+
+  f = fopen(trace_path, "w");
+  if (!f) {
+    perror(trace_path);
+    return -1;
+  }
+  if (n > 4 && strcmp(trace_path + n - 4, ".vcd") == 0)
+    vcd_dump(f, first, head, dhead);
+  else
+    bin_dump(f, first, head, dhead);
+  fclose(f);
+  fprintf(stderr, "trace: %llu records written to %s\n", (unsigned long long)(head - first), trace_path);
+  return 0;
+}
+
+void trace_poll(void) {
+  if (dump_requested && atomic_exchange(&dump_requested, 0))
+    trace_dump();
+}
+
+int trace_pending(void) {
+  return atomic_load(&dump_requested);
+}
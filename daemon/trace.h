@@ -0,0 +1,69 @@
+/*
+   JTAG activity tracer.
+
+   Every shift that goes through xvc_shift()/xvc_verify() is recorded into an
+   in-memory ring: when it started and ended, its length, and the TAP state
+   transitions its TMS vector caused. With full tracing the TMS/TDI/TDO bits
+   go into a second ring as well. The rings are dumped on SIGUSR1 and when
+   the daemon exits, either as VCD (path ending in ".vcd") or in the binary
+   format below.
+
+   Binary format, all native endian:
+     "XVCTRACE" magic, uint32_t version, uint32_t record count
+     struct trace_rec[count]
+     for every TRACE_SHIFT record with TRACE_F_BITS: TMS, TDI and TDO, each
+     (len + 7) / 8 bytes
+*/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+#define TRACE_VERSION 1
+
+enum trace_type {
+  TRACE_SHIFT = 1,  // t0..t1, len bits
+  TRACE_STATE = 2,  // TAP entered `state` at bit `bit` of the previous shift
+};
+
+enum trace_kind {
+  TRACE_KIND_SHIFT = 0,   // xvc_shift()
+  TRACE_KIND_VERIFY = 1,  // xvc_verify(), TDO is not available
+};
+
+#define TRACE_F_BITS 0x01  // TMS/TDI/TDO are part of the dump
+
+struct trace_rec {
+  uint64_t t0, t1;  // ns since the tracer started
+  uint64_t data;    // position of the bits in the data ring
+  uint32_t len;
+  uint32_t bit;
+  uint8_t type;
+  uint8_t kind;
+  uint8_t state;    // enum tap_state, TAP_STATES while unknown
+  uint8_t flags;
+};
+
+// Start tracing. With `bits` the TMS/TDI/TDO vectors are kept too.
+int trace_init(int bits, const char *path);
+
+extern int trace_enabled;
+
+uint64_t trace_now(void);
+
+// Record a completed shift, tdo may be NULL
+void trace_shift(int kind, uint32_t len, const uint8_t *tms, const uint8_t *tdi, const uint8_t *tdo, uint64_t t0,
+                 uint64_t t1);
+
+// Write the ring to the file given to trace_init()
+int trace_dump(void);
+
+// Dump if SIGUSR1 arrived since the last call. Only the thread that shifts
+// may call it, a dump reads the rings without stopping their writer.
+void trace_poll(void);
+
+// SIGUSR1 arrived and trace_poll() has not dumped yet
+int trace_pending(void);
+
+#endif
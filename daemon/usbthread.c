@@ -0,0 +1,275 @@
+/*
+   USB thread of the threaded XVC server, see usbthread.h.
+*/
+
+#define _GNU_SOURCE  // pthread_setaffinity_np()
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "trace.h"
+#include "usbthread.h"
+#include "xvcpico.h"
+
+// Jobs in flight, a power of two. The server has one at a time, the rest
+// is headroom.
+#define RING_SIZE 8
+
+// Polls before a waiting thread goes to sleep, a few tens of microseconds.
+// With a single CPU the other thread can't make progress while we spin.
+#define SPIN_LIMIT 20000
+
+// Single producer, single consumer ring. Each index is only written by one
+// side, the release/acquire pairs make the slot contents visible.
+struct spsc {
+  struct usb_job *slot[RING_SIZE];
+  _Atomic uint32_t head;  // written by the producer
+  _Atomic uint32_t tail;  // written by the consumer
+};
+
+// A thread about to sleep announces it in `sleeping` and checks its
+// condition once more. Whoever makes the condition true checks `sleeping`
+// afterwards. The fences make sure at least one of them sees the other.
+struct waiter {
+  sem_t sem;
+  atomic_int sleeping;
+};
+
+static struct spsc submitted;  // network -> USB
+static struct spsc completed;  // USB -> network
+static struct waiter usb_waiter, net_waiter;
+static atomic_int stopping;
+static pthread_t usb_thread;
+static int running;
+static int spin_limit;
+
+static int spsc_push(struct spsc *q, struct usb_job *job) {
+  uint32_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+
+  if (head - atomic_load_explicit(&q->tail, memory_order_acquire) == RING_SIZE)
+    return -1;
+  q->slot[head % RING_SIZE] = job;
+  atomic_store_explicit(&q->head, head + 1, memory_order_release);
+  return 0;
+}
+
+static struct usb_job *spsc_pop(struct spsc *q) {
+  uint32_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+  struct usb_job *job;
+
+  if (tail == atomic_load_explicit(&q->head, memory_order_acquire))
+    return NULL;
+  job = q->slot[tail % RING_SIZE];
+  atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+  return job;
+}
+
+static void wake(struct waiter *w) {
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load_explicit(&w->sleeping, memory_order_relaxed) && atomic_exchange(&w->sleeping, 0))
+    sem_post(&w->sem);
+}
+
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  asm volatile("yield");
+#endif
+}
+
+// Wait until ready(arg) is true
+static void wait_until(struct waiter *w, int (*ready)(void *arg), void *arg) {
+  int spins = 0;
+
+  while (!ready(arg)) {
+    if (spins++ < spin_limit) {
+      cpu_relax();
+      continue;
+    }
+    atomic_store(&w->sleeping, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (!ready(arg)) {
+      while (sem_wait(&w->sem) < 0 && errno == EINTR)
+        ;
+    }
+    atomic_store(&w->sleeping, 0);
+    spins = 0;
+  }
+}
+
+struct job_io {
+  struct shift_io io;
+  struct usb_job *job;
+};
+
+struct tdi_wait {
+  struct usb_job *job;
+  uint32_t upto;
+};
+
+static int tdi_ready(void *arg) {
+  struct tdi_wait *w = arg;
+  return atomic_load_explicit(&w->job->tdi_have, memory_order_acquire) >= w->upto;
+}
+
+static void job_need_tdi(struct shift_io *io, uint32_t upto) {
+  struct tdi_wait w = { ((struct job_io *)io)->job, upto };
+
+  wait_until(&usb_waiter, tdi_ready, &w);
+}
+
+static void job_tdo_ready(struct shift_io *io, uint32_t upto) {
+  atomic_store_explicit(&((struct job_io *)io)->job->tdo_have, upto, memory_order_release);
+  wake(&net_waiter);
+}
+
+static int job_or_stop(void *arg) {
+  (void)arg;
+  return atomic_load_explicit(&submitted.head, memory_order_acquire) !=
+           atomic_load_explicit(&submitted.tail, memory_order_relaxed) ||
+         atomic_load(&stopping) || trace_pending();
+}
+
+static void *usb_main(void *arg) {
+  (void)arg;
+
+  while (1) {
+    struct usb_job *job;
+
+    wait_until(&usb_waiter, job_or_stop, NULL);
+    trace_poll();
+    job = spsc_pop(&submitted);
+    if (!job) {
+      if (atomic_load(&stopping))
+        break;
+      continue;  // woken for a trace dump
+    }
+
+    struct job_io io = { { job_need_tdi, job_tdo_ready }, job };
+    xvc_shift(job->len, job->tms, job->tdi, job->tdo, &io.io);
+    atomic_store_explicit(&job->tdo_have, (job->len + 7) / 8, memory_order_release);
+    spsc_push(&completed, job);  // can't be full, the network thread waits for every job
+    wake(&net_waiter);
+  }
+  return NULL;
+}
+
+int usb_thread_start(int cpu, int rt_prio) {
+  sigset_t all, old;
+  int ret;
+
+  spin_limit = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SPIN_LIMIT : 0;
+  sem_init(&usb_waiter.sem, 0, 0);
+  sem_init(&net_waiter.sem, 0, 0);
+  atomic_store(&stopping, 0);
+
+  // Signals are left to the network thread, its select() handles them
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old);
+  ret = pthread_create(&usb_thread, NULL, usb_main, NULL);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if (ret) {
+    fprintf(stderr, "pthread_create: %s\n", strerror(ret));
+    return -1;
+  }
+  running = 1;
+  if (cpu >= 0 || rt_prio > 0) {
+    // Applied from here, the thread may already be waiting for work
+    struct sched_param param = { .sched_priority = rt_prio };
+    if (rt_prio > 0 && (ret = pthread_setschedparam(usb_thread, SCHED_FIFO, &param)))
+      fprintf(stderr, "usb thread: SCHED_FIFO priority %d: %s\n", rt_prio, strerror(ret));
+#ifdef CPU_SET
+    if (cpu >= 0) {
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      CPU_SET(cpu, &set);
+      if ((ret = pthread_setaffinity_np(usb_thread, sizeof(set), &set)))
+        fprintf(stderr, "usb thread: pinning to CPU %d: %s\n", cpu, strerror(ret));
+    }
+#endif
+  }
+  return 0;
+}
+
+void usb_thread_stop(void) {
+  if (!running)
+    return;
+  atomic_store(&stopping, 1);
+  wake(&usb_waiter);
+  pthread_join(usb_thread, NULL);
+  sem_destroy(&usb_waiter.sem);
+  sem_destroy(&net_waiter.sem);
+  running = 0;
+}
+
+void usb_thread_trace_poll(void) {
+  wake(&usb_waiter);
+}
+
+void usb_job_submit(struct usb_job *job) {
+  spsc_push(&submitted, job);  // one job at a time, never full
+  wake(&usb_waiter);
+}
+
+void usb_job_tdi(struct usb_job *job, uint32_t have) {
+  atomic_store_explicit(&job->tdi_have, have, memory_order_release);
+  wake(&usb_waiter);
+}
+
+struct tdo_wait {
+  struct usb_job *job;
+  uint32_t want;
+};
+
+static int tdo_ready(void *arg) {
+  struct tdo_wait *w = arg;
+  return atomic_load_explicit(&w->job->tdo_have, memory_order_acquire) >= w->want;
+}
+
+uint32_t usb_job_wait_tdo(struct usb_job *job, uint32_t want) {
+  struct tdo_wait w = { job, want };
+
+  wait_until(&net_waiter, tdo_ready, &w);
+  return atomic_load_explicit(&job->tdo_have, memory_order_acquire);
+}
+
+static int job_completed(void *arg) {
+  (void)arg;
+  return atomic_load_explicit(&completed.head, memory_order_acquire) !=
+         atomic_load_explicit(&completed.tail, memory_order_relaxed);
+}
+
+void usb_job_finish(struct usb_job *job) {
+  (void)job;  // jobs complete in order, and there is only one
+  wait_until(&net_waiter, job_completed, NULL);
+  spsc_pop(&completed);
+}
+
+void rt_thread_setup(const char *name, int cpu, int rt_prio) {
+  int ret;
+
+  if (rt_prio > 0) {
+    struct sched_param param = { .sched_priority = rt_prio };
+    if ((ret = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param)))
+      fprintf(stderr, "%s: SCHED_FIFO priority %d: %s\n", name, rt_prio, strerror(ret));
+  }
+#ifdef CPU_SET
+  if (cpu >= 0) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if ((ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set)))
+      fprintf(stderr, "%s: pinning to CPU %d: %s\n", name, cpu, strerror(ret));
+  }
+#else
+  if (cpu >= 0)
+    fprintf(stderr, "%s: CPU pinning is not supported here\n", name);
+#endif
+}
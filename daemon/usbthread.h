@@ -0,0 +1,65 @@
+/*
+   Threaded mode of the XVC server (xvcd-pico -j).
+
+   The network thread parses the sockets and hands every shift to a
+   dedicated USB thread as a job. Jobs go through single producer, single
+   consumer rings and the progress of a job is published with atomics, so
+   neither thread takes a lock on the way. TDI is handed over while it is
+   still arriving from the client, and TDO is handed back as the Pico
+   returns it, like the cut-through of the single threaded server.
+
+   A waiting thread spins for a while before it sleeps on a semaphore, so
+   the threads of a busy session hand over jobs without a system call.
+*/
+
+#ifndef USBTHREAD_H
+#define USBTHREAD_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+struct usb_job {
+  uint32_t len;  // bits
+  const uint8_t *tms;
+  const uint8_t *tdi;
+  uint8_t *tdo;
+  _Atomic uint32_t tdi_have;  // TDI bytes stored, advanced by the network thread
+  _Atomic uint32_t tdo_have;  // TDO bytes final, advanced by the USB thread
+};
+
+/**
+ * @brief Start the USB thread
+ *
+ * @param cpu CPU to pin it to, -1 for any
+ * @param rt_prio SCHED_FIFO priority, 0 for the normal scheduler
+ * @return 0 on success
+ */
+int usb_thread_start(int cpu, int rt_prio);
+
+void usb_thread_stop(void);
+
+// Let the USB thread write a trace dump requested with SIGUSR1. It writes
+// the trace rings, so it is the one that dumps them.
+void usb_thread_trace_poll(void);
+
+// The rest is called from the network thread only. A job is submitted with
+// tdi_have and tdo_have set, and must stay valid until usb_job_finish().
+void usb_job_submit(struct usb_job *job);
+void usb_job_tdi(struct usb_job *job, uint32_t have);
+// Wait until at least `want` TDO bytes are final, returns how many are
+uint32_t usb_job_wait_tdo(struct usb_job *job, uint32_t want);
+void usb_job_finish(struct usb_job *job);
+
+/**
+ * @brief Pin the calling thread and/or give it real-time priority
+ *
+ * Failures are reported and otherwise ignored, the server still works
+ * without either.
+ *
+ * @param name Used in messages
+ * @param cpu CPU to pin it to, -1 for any
+ * @param rt_prio SCHED_FIFO priority, 0 for the normal scheduler
+ */
+void rt_thread_setup(const char *name, int cpu, int rt_prio);
+
+#endif
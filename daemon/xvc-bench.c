@@ -0,0 +1,342 @@
+/*
+   xvc-bench: synthetic load generator for an XVC server (xvcd-pico or any
+   other), reporting throughput and shift latency.
+
+   Workloads:
+     bitstream  largest shifts the server accepts, like configuring an FPGA
+     poll       tiny shifts back to back, like an ILA being polled
+     mixed      one bitstream shift every `ratio` poll shifts
+
+   With -U the server is reached over its Unix domain socket instead, and -m
+   additionally moves the vectors through a shared memory region ("mmap:" /
+   "mshift:") so only the command crosses the socket.
+
+   TMS is kept low so the target's TAP stays in whatever stable state it is
+   in. With -l the TDO vector is compared against TDI, which needs TDI wired
+   straight to TDO.
+*/
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+enum workload { BITSTREAM, POLL, MIXED };
+
+struct lat {
+  const char *name;
+  double *us;
+  size_t n, size;
+  uint64_t bits;
+};
+
+static int sock;
+static uint32_t max_bytes;
+static int loopback;
+static unsigned long errors;
+static uint8_t *shm;  // shared with the server in -m mode
+
+static double now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int sread(void *target, size_t len) {
+  uint8_t *t = target;
+  while (len) {
+    ssize_t r = read(sock, t, len);
+    if (r <= 0)
+      return -1;
+    t += r;
+    len -= r;
+  }
+  return 0;
+}
+
+static int swrite(const void *source, size_t len) {
+  const uint8_t *s = source;
+  while (len) {
+    ssize_t r = write(sock, s, len);
+    if (r <= 0)
+      return -1;
+    s += r;
+    len -= r;
+  }
+  return 0;
+}
+
+static int xvc_connect(const char *host, const char *port, const char *unix_path) {
+  struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM }, *res;
+  char info[64];
+  int i = 1;
+  size_t n = 0;
+
+  if (unix_path) {
+    struct sockaddr_un local = { .sun_family = AF_UNIX };
+    strncpy(local.sun_path, unix_path, sizeof(local.sun_path) - 1);
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0 || connect(sock, (struct sockaddr *)&local, sizeof(local)) < 0) {
+      perror(unix_path);
+      return -1;
+    }
+  } else {
+    if (getaddrinfo(host, port, &hints, &res) != 0) {
+      fprintf(stderr, "cannot resolve %s:%s\n", host, port);
+      return -1;
+    }
+    sock = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (sock < 0 || connect(sock, res->ai_addr, res->ai_addrlen) < 0) {
+      perror("connect");
+      freeaddrinfo(res);
+      return -1;
+    }
+    freeaddrinfo(res);
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &i, sizeof i);
+  }
+
+  // "xvcServer_v1.x:<buffer size>\n"
+  if (swrite("getinfo:", 8) < 0)
+    return -1;
+  while (n < sizeof(info) - 1) {
+    if (sread(&info[n], 1) < 0)
+      return -1;
+    if (info[n++] == '\n')
+      break;
+  }
+  info[n] = 0;
+  char *colon = strchr(info, ':');
+  if (strncmp(info, "xvcServer_v1.", 13) != 0 || !colon) {
+    fprintf(stderr, "unexpected getinfo reply '%s'\n", info);
+    return -1;
+  }
+  // The buffer holds both the TMS and the TDI vector
+  max_bytes = strtoul(colon + 1, NULL, 10) / 2;
+  fprintf(stderr, "%.*s, %u bytes per vector\n", (int)(n - 1), info, max_bytes);
+  return 0;
+}
+
+// Map `size` bytes shared with the server ("mmap:<size>" -> <status> + fd)
+static uint8_t *xvc_mmap(uint32_t size) {
+  char control[CMSG_SPACE(sizeof(int))];
+  uint32_t status = 1;
+  struct iovec iov = { &status, 4 };
+  struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control) };
+  struct cmsghdr *cmsg;
+  int fd;
+  uint8_t *p;
+
+  if (swrite("mmap:", 5) < 0 || swrite(&size, 4) < 0 || recvmsg(sock, &msg, MSG_WAITALL) != 4 || status) {
+    fprintf(stderr, "mmap: refused by the server\n");
+    return NULL;
+  }
+  cmsg = CMSG_FIRSTHDR(&msg);
+  if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS) {
+    fprintf(stderr, "mmap: no memory fd received\n");
+    return NULL;
+  }
+  memcpy(&fd, CMSG_DATA(cmsg), sizeof(fd));
+  p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  return p == MAP_FAILED ? NULL : p;
+}
+
+static int xvc_shift(uint32_t bits, const uint8_t *tms, const uint8_t *tdi, uint8_t *tdo) {
+  uint32_t bytes = (bits + 7) / 8;
+  uint8_t len[4] = { bits, bits >> 8, bits >> 16, bits >> 24 };
+
+  if (shm) {
+    uint32_t cmd[4] = { bits, tms - shm, tdi - shm, tdo - shm }, status;
+    if (swrite("mshift:", 7) < 0 || swrite(cmd, sizeof(cmd)) < 0 || sread(&status, 4) < 0 || status) {
+      fprintf(stderr, "mshift failed\n");
+      return -1;
+    }
+  } else if (swrite("shift:", 6) < 0 || swrite(len, 4) < 0 || swrite(tms, bytes) < 0 ||
+             swrite(tdi, bytes) < 0 || sread(tdo, bytes) < 0) {
+    fprintf(stderr, "connection lost\n");
+    return -1;
+  }
+  if (loopback) {
+    for (uint32_t i = 0; i < bits; i++) {
+      if (((tdo[i / 8] ^ tdi[i / 8]) >> (i % 8)) & 1) {
+        errors++;
+        break;
+      }
+    }
+  }
+  return 0;
+}
+
+static void lat_add(struct lat *l, double us, uint32_t bits) {
+  if (l->n == l->size) {
+    l->size = l->size ? l->size * 2 : 4096;
+    l->us = realloc(l->us, l->size * sizeof(*l->us));
+    if (!l->us) {
+      fprintf(stderr, "out of memory\n");
+      exit(1);
+    }
+  }
+  l->us[l->n++] = us;
+  l->bits += bits;
+}
+
+static int cmp_double(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+static void lat_report(struct lat *l, double elapsed_us) {
+  if (!l->n)
+    return;
+  qsort(l->us, l->n, sizeof(*l->us), cmp_double);
+  printf("%-9s %8zu shifts %9.1f shifts/s %8.3f MB/s  latency us: p50 %8.1f  p99 %8.1f  max %8.1f\n",
+         l->name, l->n, l->n / (elapsed_us / 1e6), l->bits / 8.0 / elapsed_us,
+         l->us[l->n / 2], l->us[(size_t)(l->n * 0.99)], l->us[l->n - 1]);
+}
+
+static void usage(const char *name) {
+  fprintf(stderr, "Usage: %s [-H host] [-P port] [-w bitstream|poll|mixed] [-d seconds] [-n shifts]\n", name);
+  fprintf(stderr, "       [-s large bits] [-S small bits] [-r ratio] [-l] [-U socket [-m]]\n");
+  fprintf(stderr, "  -H  server address (default localhost)\n");
+  fprintf(stderr, "  -P  server port (default 2542)\n");
+  fprintf(stderr, "  -U  connect to the server's Unix domain socket instead\n");
+  fprintf(stderr, "  -m  pass vectors through shared memory (needs -U)\n");
+  fprintf(stderr, "  -w  workload (default mixed)\n");
+  fprintf(stderr, "  -d  run for this many seconds (default 5)\n");
+  fprintf(stderr, "  -n  stop after this many shifts instead\n");
+  fprintf(stderr, "  -s  bits per bitstream shift (default: largest the server accepts)\n");
+  fprintf(stderr, "  -S  bits per poll shift (default 64)\n");
+  fprintf(stderr, "  -r  poll shifts per bitstream shift in the mixed workload (default 16)\n");
+  fprintf(stderr, "  -l  check TDO == TDI (TDI looped back to TDO)\n");
+}
+
+int main(int argc, char **argv) {
+  const char *host = "localhost", *port = "2542", *unix_path = NULL;
+  int use_shm = 0;
+  enum workload workload = MIXED;
+  double duration = 5;
+  unsigned long count = 0;
+  uint32_t large = 0, small = 64;
+  int ratio = 16, i;
+
+  while ((i = getopt(argc, argv, "H:P:U:mw:d:n:s:S:r:lh")) != -1) {
+    switch (i) {
+      case 'H':
+        host = optarg;
+        break;
+      case 'P':
+        port = optarg;
+        break;
+      case 'U':
+        unix_path = optarg;
+        break;
+      case 'm':
+        use_shm = 1;
+        break;
+      case 'w':
+        if (strcmp(optarg, "bitstream") == 0)
+          workload = BITSTREAM;
+        else if (strcmp(optarg, "poll") == 0)
+          workload = POLL;
+        else if (strcmp(optarg, "mixed") == 0)
+          workload = MIXED;
+        else {
+          usage(argv[0]);
+          return 1;
+        }
+        break;
+      case 'd':
+        duration = atof(optarg);
+        break;
+      case 'n':
+        count = strtoul(optarg, NULL, 0);
+        break;
+      case 's':
+        large = strtoul(optarg, NULL, 0);
+        break;
+      case 'S':
+        small = strtoul(optarg, NULL, 0);
+        break;
+      case 'r':
+        ratio = atoi(optarg);
+        break;
+      case 'l':
+        loopback = 1;
+        break;
+      default:
+        usage(argv[0]);
+        return i == 'h' ? 0 : 1;
+    }
+  }
+
+  if (use_shm && !unix_path) {
+    usage(argv[0]);
+    return 1;
+  }
+  if (xvc_connect(host, port, unix_path) < 0)
+    return 1;
+  if (!large || large > max_bytes * 8)
+    large = max_bytes * 8;
+  if (!small || small > large)
+    small = large;
+  if (ratio < 1)
+    ratio = 1;
+
+  uint8_t *tms, *tdi, *tdo;
+  if (use_shm) {
+    // [tms][tdi][tdo], each the size of the largest vector
+    shm = xvc_mmap(3 * max_bytes);
+    if (!shm)
+      return 1;
+    tms = shm;
+    tdi = shm + max_bytes;
+    tdo = shm + 2 * max_bytes;
+  } else {
+    tms = calloc(max_bytes, 1);
+    tdi = malloc(max_bytes);
+    tdo = malloc(max_bytes);
+  }
+  if (!tms || !tdi || !tdo) {
+    fprintf(stderr, "out of memory\n");
+    return 1;
+  }
+  srand(time(NULL));
+  for (uint32_t b = 0; b < max_bytes; b++)
+    tdi[b] = rand();
+
+  struct lat lat_large = { .name = "bitstream" }, lat_small = { .name = "poll" };
+  double start = now_us(), end = start + duration * 1e6, t;
+  unsigned long n;
+
+  for (n = 0; count ? n < count : now_us() < end; n++) {
+    int big = workload == BITSTREAM || (workload == MIXED && n % (ratio + 1) == 0);
+    uint32_t bits = big ? large : small;
+    // Vary the TDI bits so a stuck TDO shows up in loopback mode
+    uint8_t *v = tdi + (n * 7) % (max_bytes - (bits + 7) / 8 + 1);
+
+    t = now_us();
+    if (xvc_shift(bits, tms, v, tdo) < 0)
+      return 1;
+    lat_add(big ? &lat_large : &lat_small, now_us() - t, bits);
+  }
+  double elapsed = now_us() - start;
+
+  printf("%lu shifts in %.3f s, %.3f MB/s of TDI\n", n, elapsed / 1e6,
+         (lat_large.bits + lat_small.bits) / 8.0 / elapsed);
+  lat_report(&lat_large, elapsed);
+  lat_report(&lat_small, elapsed);
+  if (loopback)
+    printf("loopback: %lu shifts with TDO != TDI\n", errors);
+
+  close(sock);
+  return loopback && errors ? 1 : 0;
+}
@@ -0,0 +1,771 @@
+/*
+   Description: Xilinx Virtual Cable Server for Raspberry Pico Board.
+
+   The XVC server: TCP (and Unix domain socket) clients and the command line
+   of xvcd-pico. Everything that talks to the Pico is in the xvcpico library,
+   see xvcpico.c and libxvcpico.h.
+
+   See Licensing information at End of File.
+*/
+
+// #define BUFFER_SIZE 1024 * 1024  // is super fast but doesn't work on ebaz4205 board ;(
+#define BUFFER_SIZE 1024 * 20 // NOTE: Reduce this in case of flashing problems!
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <time.h>
+
+#include "chain.h"
+#include "libxvcpico.h"
+#include "trace.h"
+#include "usbthread.h"
+#include "xvcpico.h"
+
+// Default PMOD clock of -S, about what USB full speed can take (2 bits a clock)
+#define STREAM_KHZ 4000
+
+static char xvcInfo[64];
+static int verbose = 0;
+static int streaming = 1;
+static int threaded = 0;
+static int sread(int fd, void *target, int len) {
+  unsigned char *t = target;
+  while (len) {
+    int r = read(fd, t, len);
+    if (r <= 0)
+      return r;
+    t += r;
+    len -= r;
+  }
+  return 1;
+}
+
+static unsigned char buffer[BUFFER_SIZE], result[BUFFER_SIZE / 2];
+
+// Cut-through state for one "shift:" command: TDI is pulled from the socket
+// only as far as the USB side needs it, and TDO is pushed back in chunks.
+#define STREAM_CHUNK 4096
+
+struct xvc_stream {
+  struct shift_io io;
+  int fd;
+  uint8_t *tdi;
+  uint8_t *tdo;
+  uint32_t nr_bytes;
+  uint32_t tdi_have;
+  uint32_t tdo_sent;
+  int failed;
+};
+
+static void stream_need_tdi(struct shift_io *io, uint32_t upto) {
+  struct xvc_stream *s = (struct xvc_stream *)io;
+
+  while (s->tdi_have < upto) {
+    int r = read(s->fd, s->tdi + s->tdi_have, s->nr_bytes - s->tdi_have);
+    if (r <= 0) {
+      // Keep clocking so the firmware does not lose track of the shift
+      fprintf(stderr, "reading data failed\n");
+      memset(s->tdi + s->tdi_have, 0, s->nr_bytes - s->tdi_have);
+      s->tdi_have = s->nr_bytes;
+      s->failed = 1;
+      return;
+    }
+    s->tdi_have += r;
+  }
+}
+
+static void stream_tdo_ready(struct shift_io *io, uint32_t upto) {
+  struct xvc_stream *s = (struct xvc_stream *)io;
+
+  if (s->failed || upto - s->tdo_sent < STREAM_CHUNK)
+    return;
+  // Never block here: the client may still be busy sending us TDI
+  ssize_t r = send(s->fd, s->tdo + s->tdo_sent, upto - s->tdo_sent, MSG_DONTWAIT);
+  if (r > 0)
+    s->tdo_sent += r;
+}
+
+// The same for the threaded server (-j): the USB thread shifts while this
+// thread keeps feeding it TDI and sending back TDO, see usbthread.h.
+static int shift_threaded(int fd, uint32_t len, uint32_t nr_bytes) {
+  struct usb_job job = { .len = len, .tms = buffer, .tdi = &buffer[nr_bytes], .tdo = result };
+  uint32_t have = streaming ? 0 : nr_bytes, sent = 0;
+  int failed = 0;
+
+  atomic_init(&job.tdi_have, have);
+  atomic_init(&job.tdo_have, 0);
+  usb_job_submit(&job);
+  while (have < nr_bytes) {
+    int r = read(fd, &buffer[nr_bytes + have], nr_bytes - have);
+    if (r <= 0) {
+      // Keep clocking so the firmware does not lose track of the shift
+      fprintf(stderr, "reading data failed\n");
+      memset(&buffer[nr_bytes + have], 0, nr_bytes - have);
+      have = nr_bytes;
+      failed = 1;
+    } else {
+      have += r;
+    }
+    usb_job_tdi(&job, have);
+
+    // Never block here: the client may still be busy sending us TDI
+    uint32_t ready = atomic_load_explicit(&job.tdo_have, memory_order_acquire);
+    if (!failed && ready - sent >= STREAM_CHUNK) {
+      ssize_t w = send(fd, result + sent, ready - sent, MSG_DONTWAIT);
+      if (w > 0)
+        sent += w;
+    }
+  }
+  while (!failed && sent < nr_bytes) {
+    uint32_t want = nr_bytes - sent > STREAM_CHUNK ? sent + STREAM_CHUNK : nr_bytes;
+    uint32_t ready = usb_job_wait_tdo(&job, want);
+    if (write(fd, result + sent, ready - sent) != ready - sent) {
+      perror("write 3: Reduce BUFFER_SIZE in xvcpico.c");
+      failed = 3;
+      break;
+    }
+    sent = ready;
+  }
+  usb_job_finish(&job);
+  return failed;
+}
+
+// Clients on the Unix domain socket can share a memory region with the
+// daemon and shift vectors in place:
+//   "mmap:<size>"                            -> <status>, fd of the region
+//   "mshift:<num bits><tms><tdi><tdo offset>" -> <status>
+// All fields are 32bit little endian, status is zero on success. The region
+// is a ring the client manages itself, each mshift names where its vectors
+// live, so only these few bytes cross the socket.
+#define SHM_MAX (256 * 1024 * 1024)
+
+static struct xvc_client {
+  _Bool local;
+  uint8_t *shm;
+  size_t shm_size;
+} clients[FD_SETSIZE];
+
+static void client_close(int fd) {
+  if (clients[fd].shm)
+    munmap(clients[fd].shm, clients[fd].shm_size);
+  memset(&clients[fd], 0, sizeof(clients[fd]));
+  close(fd);
+}
+
+// Create an anonymous shared memory object and hand its fd to the client
+static int shm_attach(int fd, uint32_t size) {
+  struct xvc_client *c = &clients[fd];
+  char name[64];
+  int shm_fd;
+
+  if (!c->local || c->shm || size == 0 || size > SHM_MAX)
+    return -1;
+  snprintf(name, sizeof(name), "/xvcd-pico-%d-%d", (int)getpid(), fd);
+  shm_fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (shm_fd < 0) {
+    perror("shm_open");
+    return -1;
+  }
+  shm_unlink(name);
+  if (ftruncate(shm_fd, size) < 0) {
+    perror("ftruncate");
+    close(shm_fd);
+    return -1;
+  }
+  c->shm = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+  if (c->shm == MAP_FAILED) {
+    perror("mmap");
+    c->shm = NULL;
+    close(shm_fd);
+    return -1;
+  }
+  c->shm_size = size;
+  return shm_fd;
+}
+
+static int send_fd(int fd, uint32_t status, int pass_fd) {
+  char control[CMSG_SPACE(sizeof(int))];
+  struct iovec iov = { &status, 4 };
+  struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+
+  if (pass_fd >= 0) {
+    memset(control, 0, sizeof(control));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &pass_fd, sizeof(int));
+  }
+  return sendmsg(fd, &msg, 0) == 4 ? 0 : -1;
+}
+
+static _Bool shm_range(struct xvc_client *c, uint32_t offset, uint32_t size) {
+  return c->shm && (uint64_t)offset + size <= c->shm_size;
+}
+
+int handle_data(int fd) {
+  uint32_t len, nr_bytes;
+
+  do {
+    char cmd[16];
+    memset(cmd, 0, 16);
+
+    if (sread(fd, cmd, 2) != 1)
+      return 1;
+
+    if (memcmp(cmd, "ge", 2) == 0) {
+      if (sread(fd, cmd, 6) != 1)
+        return 1;
+      memcpy(result, xvcInfo, strlen(xvcInfo));
+      if (write(fd, result, strlen(xvcInfo)) != (ssize_t)strlen(xvcInfo)) {
+        perror("write 1");
+        return 1;
+      }
+      if (verbose) {
+        printf("%u : Received command: 'getinfo'\n", (int)time(NULL));
+        printf("\t Replied with %s\n", xvcInfo);
+      }
+      break;
+    } else if (memcmp(cmd, "se", 2) == 0) {
+      if (sread(fd, cmd, 9) != 1)
+        return 1;
+      memcpy(result, cmd + 5, 4);
+      if (write(fd, result, 4) != 4) {
+        perror("write 2");
+        return 2;
+      }
+      if (verbose) {
+        printf("%u : Received command: 'settck'\n", (int)time(NULL));
+        printf("\t Replied with '%.*s'\n\n", 4, cmd + 5);
+      }
+      break;
+    } else if (memcmp(cmd, "de", 2) == 0) {  // DEBUG CODE
+      if (sread(fd, cmd, 3) != 1)
+        return 1;
+      printf("%u : Received command: 'debug'\n", (int)time(NULL));
+      gpio_write(1, 1, 1);
+      break;
+    } else if (memcmp(cmd, "of", 2) == 0) {  // DEBUG CODE
+      if (sread(fd, cmd, 1) != 1)
+        return 1;
+      printf("%u : Received command: 'off'\n", (int)time(NULL));
+      gpio_write(0, 0, 0);
+      break;
+    } else if (memcmp(cmd, "mr", 2) == 0 || memcmp(cmd, "mw", 2) == 0) {
+      // "mrd:<flags><address><num bytes>"       -> <data><status>
+      // "mwr:<flags><address><num bytes><data>" -> <status>
+      // flags and num bytes are 32bit, address is 64bit, all little endian.
+      // status is 32bit, zero on success.
+      _Bool write_cmd = cmd[1] == 'w';
+      uint8_t hdr[16];
+      uint64_t address;
+      uint32_t num_bytes, status;
+
+      if (sread(fd, cmd, 2) != 1 || sread(fd, hdr, sizeof(hdr)) != 1)
+        return 1;
+      memcpy(&address, &hdr[4], 8);
+      memcpy(&num_bytes, &hdr[12], 4);
+      if (num_bytes > sizeof(result)) {
+        fprintf(stderr, "buffer size exceeded\n");
+        return 1;
+      }
+      if (write_cmd && sread(fd, result, num_bytes) != 1) {
+        fprintf(stderr, "reading data failed\n");
+        return 1;
+      }
+      if (verbose) {
+        printf("%u : Received command: '%s'\n", (int)time(NULL), write_cmd ? "mwr" : "mrd");
+        printf("\tAddress : 0x%llx, Number of Bytes : %u\n", (unsigned long long)address, num_bytes);
+      }
+
+      status = 0;
+      if (address > 0xFFFFFFFFull || address + num_bytes > 0x100000000ull ||
+          axm_access(write_cmd, (uint32_t)address, result, num_bytes)) {
+        status = 1;
+        if (!write_cmd)
+          memset(result, 0, num_bytes);
+      }
+      if (!write_cmd) {
+        if (write(fd, result, num_bytes) != (ssize_t)num_bytes) {
+          perror("write 4");
+          return 4;
+        }
+      }
+      if (write(fd, &status, 4) != 4) {
+        perror("write 4");
+        return 4;
+      }
+      break;
+    } else if (memcmp(cmd, "mm", 2) == 0) {
+      uint32_t size;
+      int shm_fd;
+
+      if (sread(fd, cmd, 3) != 1 || sread(fd, &size, 4) != 1)
+        return 1;
+      if (verbose)
+        printf("%u : Received command: 'mmap', %u bytes\n", (int)time(NULL), size);
+      shm_fd = shm_attach(fd, size);
+      if (send_fd(fd, shm_fd < 0, shm_fd) < 0) {
+        perror("write 5");
+        if (shm_fd >= 0)
+          close(shm_fd);
+        return 5;
+      }
+      if (shm_fd >= 0)
+        close(shm_fd);
+      break;
+    } else if (memcmp(cmd, "ms", 2) == 0) {
+      struct xvc_client *c = &clients[fd];
+      uint32_t arg[4], status = 1;
+
+      if (sread(fd, cmd, 5) != 1 || sread(fd, arg, sizeof(arg)) != 1)
+        return 1;
+      // Done in 64 bits, a length near 4G bits would wrap to 0 bytes and
+      // pass any range check
+      nr_bytes = ((uint64_t)arg[0] + 7) / 8;
+      if (verbose)
+        printf("%u : Received command: 'mshift', %u bits\n", (int)time(NULL), arg[0]);
+      if (shm_range(c, arg[1], nr_bytes) && shm_range(c, arg[2], nr_bytes) && shm_range(c, arg[3], nr_bytes)) {
+        if (threaded) {
+          struct usb_job job = { .len = arg[0], .tms = c->shm + arg[1], .tdi = c->shm + arg[2], .tdo = c->shm + arg[3] };
+          atomic_init(&job.tdi_have, nr_bytes);
+          atomic_init(&job.tdo_have, 0);
+          usb_job_submit(&job);
+          usb_job_finish(&job);
+        } else {
+          xvc_shift(arg[0], c->shm + arg[1], c->shm + arg[2], c->shm + arg[3], NULL);
+        }
+        status = 0;
+      }
+      if (write(fd, &status, 4) != 4) {
+        perror("write 5");
+        return 5;
+      }
+      break;
+    } else if (memcmp(cmd, "sh", 2) == 0) {
+      if (sread(fd, cmd, 4) != 1)
+        return 1;
+      if (verbose) {
+        printf("%u : Received command: 'shift'\n", (int)time(NULL));
+      }
+    } else {
+      fprintf(stderr, "invalid cmd '%s'\n", cmd);
+      return 1;
+    }
+
+    // Handling for -> "shift:<num bits><tms vector><tdi vector>"
+    if (sread(fd, &len, 4) != 1) {
+      fprintf(stderr, "reading length failed\n");
+      return 1;
+    }
+
+    nr_bytes = (len + 7) / 8;
+    if (nr_bytes * 2 > sizeof(buffer)) {
+      fprintf(stderr, "buffer size exceeded\n");
+      return 1;
+    }
+
+    // In streaming mode only the TMS vector is needed up front, TDI is
+    // pulled in by jtag_shift() as the USB side catches up with it.
+    if (sread(fd, buffer, streaming ? nr_bytes : nr_bytes * 2) != 1) {
+      fprintf(stderr, "reading data failed\n");
+      return 1;
+    }
+    memset(result, 0, nr_bytes);
+
+    if (verbose) {
+      printf("\tNumber of Bits  : %d\n", len);
+      printf("\tNumber of Bytes : %d \n", nr_bytes);
+      printf("\n");
+    }
+
+    if (threaded) {
+      int ret = shift_threaded(fd, len, nr_bytes);
+      if (ret)
+        return ret;
+      continue;
+    }
+
+    struct xvc_stream stream = {
+      .io = { stream_need_tdi, stream_tdo_ready },
+      .fd = fd,
+      .tdi = &buffer[nr_bytes],
+      .tdo = result,
+      .nr_bytes = nr_bytes,
+    };
+
+    xvc_shift(len, buffer, &buffer[nr_bytes], result, streaming ? &stream.io : NULL);
+
+    if (stream.failed)
+      return 1;
+    if (write(fd, result + stream.tdo_sent, nr_bytes - stream.tdo_sent) != nr_bytes - stream.tdo_sent) {
+      perror("write 3: Reduce BUFFER_SIZE in xvcpico.c");
+      return 3;
+    }
+
+  } while (1);
+  /* Note: Need to fix JTAG state updates, until then no exit is allowed */
+  return 0;
+}
+
+static void usage(const char *name) {
+  fprintf(stderr, "Usage: %s [-v] [-b] [-g targets] [-u socket] [-t|-T trace] [-p file.svf|file.xsvf]\n"
+          "       [-B shift|loop|echo] [-s file.svf|file.xsvf [-a]] [-r] [-f|-V file.bin]\n"
+          "       [-S file|-|:port [-k kHz]] [-j] [-C cpu[,cpu]] [-R prio] [-M] [-c]\n", name);
+  fprintf(stderr, "  -v  verbose output\n");
+  fprintf(stderr, "  -b  buffer whole shift payloads instead of streaming them\n");
+  fprintf(stderr, "  -g  gang mode, drive up to %d identical targets at once\n", GANG_MAX);
+  fprintf(stderr, "  -u  also listen on this Unix domain socket (allows shared memory shifts)\n");
+  fprintf(stderr, "  -t  trace shifts and TAP states, dump to this file on SIGUSR1 and exit\n");
+  fprintf(stderr, "      (VCD if the name ends in .vcd, binary otherwise)\n");
+  fprintf(stderr, "  -T  like -t, and keep the TMS/TDI/TDO bits as well\n");
+  fprintf(stderr, "  -p  play an SVF/XSVF file and exit instead of serving XVC\n");
+  fprintf(stderr, "  -B  measure the Pico and exit: shift engine alone (shift), the same with\n");
+  fprintf(stderr, "      TDI wired to TDO and checked (loop), or raw USB throughput (echo)\n");
+  fprintf(stderr, "  -s  compile an SVF/XSVF file into the Pico's flash and exit\n");
+  fprintf(stderr, "  -a  with -s, also play the stored file every time the Pico powers up\n");
+  fprintf(stderr, "  -r  play the file stored in the Pico's flash and exit\n");
+  fprintf(stderr, "  -f  write a raw image to the target's SPI configuration flash and exit\n");
+  fprintf(stderr, "  -V  compare the target's SPI configuration flash with a raw image and exit\n");
+  fprintf(stderr, "  -S  stream from the FPGA over the PMOD pins to a file, stdout (-) or one TCP\n");
+  fprintf(stderr, "      client (:port) until Ctrl-C, then exit\n");
+  fprintf(stderr, "  -k  PMOD clock for -S in kHz (default %d)\n", STREAM_KHZ);
+  fprintf(stderr, "  -j  serve XVC from two threads, one for the network and one for USB\n");
+  fprintf(stderr, "  -C  pin the USB thread (and the network thread) to these CPUs\n");
+  fprintf(stderr, "  -R  run with this SCHED_FIFO real-time priority\n");
+  fprintf(stderr, "  -M  lock all memory, so page faults can't stall a shift\n");
+  fprintf(stderr, "  -c  scan the JTAG chain at startup and print its devices\n");
+}
+
+int main(int argc, char **argv) {
+  struct chain_device chain[CHAIN_MAX];
+  int i;
+  int s;
+  struct sockaddr_in address;
+  const char *play = NULL;
+  const char *bench = NULL;
+  const char *store = NULL;
+  const char *spi_image = NULL;
+  int spi_verify_only = 0;
+  const char *stream_dest = NULL;
+  int stream_khz = STREAM_KHZ;
+  int store_flags = 0;
+  int replay = 0;
+  const char *unix_path = NULL;
+  const char *trace_path = NULL;
+  int trace_bits = 0;
+  int gang_targets = 1;
+  int usb_cpu = -1, net_cpu = -1;
+  int rt_prio = 0;
+  int lock_memory = 0;
+  int scan = 0;
+  int us = -1;
+
+  while ((i = getopt(argc, argv, "vbg:u:t:T:p:B:s:arf:V:S:k:jC:R:Mch")) != -1) {
+    switch (i) {
+      case 'v':
+        verbose = 1;
+        break;
+      case 'b':
+        streaming = 0;
+        break;
+      case 'g':
+        gang_targets = atoi(optarg);
+        if (gang_targets < 1 || gang_targets > GANG_MAX) {
+          fprintf(stderr, "gang mode supports 1 to %d targets\n", GANG_MAX);
+          return 1;
+        }
+        break;
+      case 'u':
+        unix_path = optarg;
+        break;
+      case 'T':
+        trace_bits = 1;
+      // fall through
+      case 't':
+        trace_path = optarg;
+        break;
+      case 'p':
+        play = optarg;
+        break;
+      case 'B':
+        bench = optarg;
+        break;
+      case 's':
+        store = optarg;
+        break;
+      case 'a':
+        store_flags |= STORE_AUTORUN;
+        break;
+      case 'r':
+        replay = 1;
+        break;
+      case 'V':
+        spi_verify_only = 1;
+      // fall through
+      case 'f':
+        spi_image = optarg;
+        break;
+      case 'S':
+        stream_dest = optarg;
+        break;
+      case 'k':
+        stream_khz = atoi(optarg);
+        if (stream_khz < 1 || stream_khz > 65535) {
+          fprintf(stderr, "the PMOD clock must be 1 to 65535 kHz\n");
+          return 1;
+        }
+        break;
+      case 'j':
+        threaded = 1;
+        break;
+      case 'C':
+        if (sscanf(optarg, "%d,%d", &usb_cpu, &net_cpu) < 1 || usb_cpu < 0) {
+          fprintf(stderr, "-C takes a CPU number, or two separated by a comma\n");
+          return 1;
+        }
+        break;
+      case 'R':
+        rt_prio = atoi(optarg);
+        if (rt_prio < 1 || rt_prio > 99) {
+          fprintf(stderr, "the real-time priority must be 1 to 99\n");
+          return 1;
+        }
+        break;
+      case 'M':
+        lock_memory = 1;
+        break;
+      case 'c':
+        scan = 1;
+        break;
+      default:
+        usage(argv[0]);
+        return i == 'h' ? 0 : 1;
+    }
+  }
+
+  // Init
+  if (trace_path && trace_init(trace_bits, trace_path))
+    return 1;
+  if (stream_dest && stream_open(stream_dest))
+    return 1;
+  sprintf(xvcInfo, "xvcServer_v1.1:%d\n", BUFFER_SIZE);
+  if (xvcpico_open(gang_targets))
+    return -1;
+  if (gang_targets > 1)
+    fprintf(stderr, "Gang mode: comparing TDO of %d targets\n", gang_targets);
+  if (bench) {
+    i = selftest(bench);
+    xvcpico_close();
+    return i;
+  }
+  if (store || replay) {
+    i = 0;
+    if (store)
+      i = store_file(store, store_flags);
+    if (!i && replay)
+      i = store_replay();
+    xvcpico_close();
+    return i ? 1 : 0;
+  }
+  if (stream_dest) {
+    i = stream_run(stream_dest, stream_khz);
+    xvcpico_close();
+    return i ? 1 : 0;
+  }
+  // Drives the TAPs, so only when asked for or needed
+  i = scan || spi_image ? chain_scan(chain, CHAIN_MAX) : 0;
+  if (spi_image) {
+    i = spiflash_program(spi_image, spi_verify_only, chain, i);
+    xvcpico_close();
+    return i ? 1 : 0;
+  }
+  if (play) {
+    i = svf_play(play);
+    trace_dump();
+    xvcpico_close();
+    return i ? 1 : 0;
+  }
+  fprintf(stderr, "XVCPI is listening now with BUFFER_SIZE => %d!\n", BUFFER_SIZE/2);
+  if (streaming)
+    fprintf(stderr, "Streaming shift payloads (use -b to disable)\n");
+  s = socket(AF_INET, SOCK_STREAM, 0);
+  if (s < 0) {
+    perror("socket");
+    xvcpico_close();
+    return 1;
+  }
+  i = 1;
+  setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &i, sizeof i);
+  address.sin_addr.s_addr = INADDR_ANY;
+  address.sin_port = htons(2542);
+  address.sin_family = AF_INET;
+
+  if (bind(s, (struct sockaddr *)&address, sizeof(address)) < 0) {
+    perror("bind");
+    xvcpico_close();
+    return 1;
+  }
+
+  if (listen(s, 0) < 0) {
+    perror("listen");
+    xvcpico_close();
+    return 1;
+  }
+
+  if (unix_path) {
+    struct sockaddr_un local = { .sun_family = AF_UNIX };
+    struct stat st;
+
+    if (strlen(unix_path) >= sizeof(local.sun_path)) {
+      fprintf(stderr, "socket path too long\n");
+      xvcpico_close();
+      return 1;
+    }
+    strcpy(local.sun_path, unix_path);
+    // Remove a stale socket from an earlier run, but nothing else
+    if (lstat(unix_path, &st) == 0 && S_ISSOCK(st.st_mode))
+      unlink(unix_path);
+    us = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (us < 0 || bind(us, (struct sockaddr *)&local, sizeof(local)) < 0 || listen(us, 0) < 0) {
+      perror(unix_path);
+      xvcpico_close();
+      return 1;
+    }
+    fprintf(stderr, "Also listening on %s\n", unix_path);
+  }
+
+  if (lock_memory && mlockall(MCL_CURRENT | MCL_FUTURE) < 0)
+    perror("mlockall");
+  if (threaded) {
+    if (usb_thread_start(usb_cpu, rt_prio)) {
+      if (unix_path)
+        unlink(unix_path);
+      xvcpico_close();
+      return 1;
+    }
+    rt_thread_setup("network thread", net_cpu, rt_prio);
+    fprintf(stderr, "Threaded: USB and network on separate threads\n");
+  } else {
+    // One thread does it all, so it gets the USB thread's settings
+    rt_thread_setup("xvcd-pico", usb_cpu, rt_prio);
+  }
+
+  fd_set conn;
+  int maxfd = 0;
+  FD_ZERO(&conn);
+  FD_SET(s, &conn);
+  maxfd = s;
+  if (us >= 0) {
+    FD_SET(us, &conn);
+    if (us > maxfd)
+      maxfd = us;
+  }
+
+  while (1) {
+    fd_set read = conn, except = conn;
+    int fd;
+
+    if (select(maxfd + 1, &read, 0, &except, 0) < 0) {
+      if (errno == EINTR) {
+        // The rings are only dumped by the thread that writes them
+        if (threaded)
+          usb_thread_trace_poll();
+        else
+          trace_poll();
+        continue;
+      }
+      perror("select");
+      break;
+    }
+
+    for (fd = 0; fd <= maxfd; ++fd) {
+      if (FD_ISSET(fd, &read)) {
+        if (fd == s) {
+          int newfd;
+          socklen_t nsize = sizeof(address);
+
+          newfd = accept(s, (struct sockaddr *)&address, &nsize);
+          if (verbose)
+            printf("connection accepted - fd %d\n", newfd);
+          if (newfd < 0) {
+            perror("accept");
+          } else {
+            int flag = 1;
+            int optResult = setsockopt(newfd, IPPROTO_TCP, TCP_NODELAY, (char *)&flag, sizeof(int));
+            if (optResult < 0)
+              perror("TCP_NODELAY error");
+            if (newfd > maxfd) {
+              maxfd = newfd;
+            }
+            FD_SET(newfd, &conn);
+          }
+        } else if (fd == us) {
+          int newfd = accept(us, NULL, NULL);
+          if (verbose)
+            printf("local connection accepted - fd %d\n", newfd);
+          if (newfd < 0) {
+            perror("accept");
+          } else if (newfd >= FD_SETSIZE) {
+            close(newfd);
+          } else {
+            clients[newfd].local = 1;
+            if (newfd > maxfd)
+              maxfd = newfd;
+            FD_SET(newfd, &conn);
+          }
+        } else if (handle_data(fd)) {
+          if (verbose)
+            printf("connection closed - fd %d\n", fd);
+          client_close(fd);
+          FD_CLR(fd, &conn);
+        }
+      } else if (FD_ISSET(fd, &except)) {
+        if (verbose)
+          printf("connection aborted - fd %d\n", fd);
+        client_close(fd);
+        FD_CLR(fd, &conn);
+        if (fd == s)
+          break;
+      }
+    }
+  }
+
+  if (unix_path)
+    unlink(unix_path);
+  usb_thread_stop();
+  trace_dump();
+  xvcpico_close();
+  return 0;
+}
+
+
+/*
+   This work, "xvcpi.c", is a derivative of "xvcServer.c" (https://github.com/Xilinx/XilinxVirtualCable)
+   by Avnet and is used by Xilinx for XAPP1251.
+
+   "xvcServer.c" is licensed under CC0 1.0 Universal (http://creativecommons.org/publicdomain/zero/1.0/)
+   by Avnet and is used by Xilinx for XAPP1251.
+
+   "xvcServer.c", is a derivative of "xvcd.c" (https://github.com/tmbinc/xvcd)
+   by tmbinc, used under CC0 1.0 Universal (http://creativecommons.org/publicdomain/zero/1.0/).
+
+   Portions of "xvcpi.c" are derived from OpenOCD (http://openocd.org)
+
+   "xvcpi.c" is licensed under CC0 1.0 Universal (http://creativecommons.org/publicdomain/zero/1.0/)
+   by Derek Mulcahy.
+*/
@@ -14,21 +14,23 @@
    - https://github.com/kholia/xvcpi/blob/master/xvcpi.c (CC0 1.0 Universal)
    - https://github.com/phdussud/pico-dirtyJtag/blob/master/cmd.c
 
+   This file drives the Pico over USB. The XVC server is in xvcd.c, the
+   library API on top of both is in libxvcpico.h.
+
    See Licensing information at End of File.
 */
 
+#include <errno.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <netinet/in.h>
-#include <netinet/tcp.h>
-#include <sys/socket.h>
 #include <sys/types.h>
+#include <time.h>
 
-// #define BUFFER_SIZE 1024 * 1024  // is super fast but doesn't work on ebaz4205 board ;(
-#define BUFFER_SIZE 1024 * 20 // NOTE: Reduce this in case of flashing problems!
+#include "trace.h"
+#include "xvcpico.h"
 
 #ifdef __CYGWIN__
 #include <libusb-1.0/libusb.h>
@@ -40,18 +42,95 @@
 #define XVCPICO_INTF 3
 #define XVCPICO_READ_EP 0x86
 #define XVCPICO_WRITE_EP 0x05
+#define XVCPICO_AXM_INTF 2
+#define XVCPICO_AXM_READ_EP 0x84
+#define XVCPICO_AXM_WRITE_EP 0x03
+#define AXM_MAX_BURST (0x3ff + 8)  // 10bit LEN, see axm_len()
+#define AXM_BURST 1024             // bursts axm_access() splits into, keeps the next one aligned
 libusb_context *usb_ctx;
 libusb_device_handle *dev_handle = NULL;
+static int axm_claimed = 0;
+static volatile int stream_running;  // pico_stream(), the PMOD pins are taken
+
+// USB transfer buffers. They are carved out of one pool that is allocated
+// once in device_init(), preferably with libusb_dev_mem_alloc() so usbfs can
+// use the (mmap()ed) pages directly instead of copying them on every
+// submission. Falls back to malloc() where that is not supported.
+enum usb_buf_id {
+  USB_BUF_TX,      // gpio_send()
+  USB_BUF_RX,      // gpio_recieve()
+  USB_BUF_CTRL,    // gpio_write()
+  USB_BUF_AXM_TX,  // axm_transfer()
+  USB_BUF_AXM_RX,
+  USB_BUF_COUNT,
+};
+static const uint32_t usb_buf_size[USB_BUF_COUNT] = { 512, 512, 8, 64, AXM_MAX_BURST };
+static unsigned char *usb_buf[USB_BUF_COUNT];
+static int ep_size;
+static unsigned char *usb_pool;
+static size_t usb_pool_size;
+static _Bool usb_pool_dev_mem;
+
+static int usb_pool_init() {
+  usb_pool_size = 0;
+  for (int i = 0; i < USB_BUF_COUNT; i++)
+    usb_pool_size += (usb_buf_size[i] + 63) & ~63u;
+
+  usb_pool = NULL;
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+  usb_pool = libusb_dev_mem_alloc(dev_handle, usb_pool_size);
+#endif
+  usb_pool_dev_mem = usb_pool != NULL;
+  if (!usb_pool)
+    usb_pool = malloc(usb_pool_size);
+  if (!usb_pool)
+    return -1;
+
+  size_t offset = 0;
+  for (int i = 0; i < USB_BUF_COUNT; i++) {
+    usb_buf[i] = usb_pool + offset;
+    offset += (usb_buf_size[i] + 63) & ~63u;
+  }
+  return 0;
+}
 
-static char xvcInfo[64];
+static void usb_pool_free() {
+  if (!usb_pool)
+    return;
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+  if (usb_pool_dev_mem) {
+    libusb_dev_mem_free(dev_handle, usb_pool, usb_pool_size);
+    usb_pool = NULL;
+    return;
+  }
+#endif
+  free(usb_pool);
+  usb_pool = NULL;
+}
 
 // Note: Modified!
 enum xvcPicoCmd {
   CMD_STOP = 0x00,
   CMD_XFER = 0x03,
   CMD_WRITE = 0x04,
+  CMD_GANG = 0x05,
+  CMD_GANG_STATUS = 0x06,
+  CMD_VERIFY = 0x07,
+  CMD_SHIFT_SMALL = 0x08,
+  CMD_PAD = 0x09,
+  CMD_STORE_BEGIN = 0x0A,
+  CMD_STORE_DATA = 0x0B,
+  CMD_STORE_END = 0x0C,
+  CMD_REPLAY = 0x0D,
+  CMD_SPI = 0x0E,
 };
 
+// Flag for CMD_XFER/CMD_PAD: more segments of the same shift follow
+#define CMD_MORE 0x10
+
+// Shifts up to this many bits go out as one CMD_SHIFT_SMALL packet
+#define SMALL_SHIFT_BITS 248
+
 /*
   enum libusb_error {
     LIBUSB_SUCCESS             = 0,
@@ -71,15 +150,15 @@ enum xvcPicoCmd {
   };
 */
 
-void gpio_send(_Bool header, uint32_t len, uint32_t n, uint8_t *tms, uint8_t *tdi) {
-  unsigned char tx_buffer[512];
+int gpio_send(_Bool header, uint32_t len, uint32_t n, const uint8_t *tms, const uint8_t *tdi, _Bool more) {
+  unsigned char *tx_buffer = usb_buf[USB_BUF_TX];
   int actual_length, ret, header_offset = 0;
 
   int bytes = (n + 7) / 8;
 
   if (header) {
     // Replace these with memcpy
-    tx_buffer[header_offset++] = CMD_XFER;
+    tx_buffer[header_offset++] = CMD_XFER | (more ? CMD_MORE : 0);
     tx_buffer[header_offset++] = (len >> 0) & 0xFF;  // uint32_t to bytes
     tx_buffer[header_offset++] = (len >> 8) & 0xFF;
     tx_buffer[header_offset++] = (len >> 16) & 0xFF;
@@ -95,33 +174,93 @@ void gpio_send(_Bool header, uint32_t len, uint32_t n, uint8_t *tms, uint8_t *td
   ret = libusb_bulk_transfer(dev_handle, XVCPICO_WRITE_EP, tx_buffer, header_offset, &actual_length, 1000);
   if ((ret < 0) || (actual_length != header_offset)) {
     printf("gpio_xfer_full: usb bulk write failed!\n");
-    return;
+    return -1;
   }
+  return 0;
 }
 
-void gpio_recieve(uint32_t n, uint8_t *tdo) {
-  unsigned char result[256];
+// Same packet layout as gpio_send(), with expected TDO and mask bytes
+// following every TMS/TDI pair
+int gpio_send_verify(_Bool header, uint32_t len, uint32_t n, const uint8_t *tms, const uint8_t *tdi,
+                     const uint8_t *exp, const uint8_t *mask) {
+  unsigned char *tx_buffer = usb_buf[USB_BUF_TX];
+  int actual_length, ret, header_offset = 0;
+
+  int bytes = (n + 7) / 8;
+
+  if (header) {
+    tx_buffer[header_offset++] = CMD_VERIFY;
+    tx_buffer[header_offset++] = (len >> 0) & 0xFF;
+    tx_buffer[header_offset++] = (len >> 8) & 0xFF;
+    tx_buffer[header_offset++] = (len >> 16) & 0xFF;
+    tx_buffer[header_offset++] = (len >> 24) & 0xFF;
+  }
+
+  for (int i = 0; i < bytes; i++) {
+    tx_buffer[header_offset++] = tms[i];
+    tx_buffer[header_offset++] = tdi[i];
+    tx_buffer[header_offset++] = exp[i];
+    tx_buffer[header_offset++] = mask[i];
+  }
+
+  actual_length = 0;
+  ret = libusb_bulk_transfer(dev_handle, XVCPICO_WRITE_EP, tx_buffer, header_offset, &actual_length, 1000);
+  if ((ret < 0) || (actual_length != header_offset)) {
+    printf("gpio_send_verify: usb bulk write failed!\n");
+    return -1;
+  }
+  return 0;
+}
+
+// Clock `n` bits of constant TMS/TDI without sending them
+int gpio_pad(uint32_t n, int tms, int tdi, _Bool more) {
+  unsigned char *tx_buffer = usb_buf[USB_BUF_TX];
+  int actual_length, ret, header_offset = 0;
+
+  tx_buffer[header_offset++] = CMD_PAD | (more ? CMD_MORE : 0);
+  tx_buffer[header_offset++] = (n >> 0) & 0xFF;
+  tx_buffer[header_offset++] = (n >> 8) & 0xFF;
+  tx_buffer[header_offset++] = (n >> 16) & 0xFF;
+  tx_buffer[header_offset++] = (n >> 24) & 0xFF;
+  tx_buffer[header_offset++] = tms & 1;
+  tx_buffer[header_offset++] = tdi & 1;
+  tx_buffer[header_offset++] = CMD_STOP;
+
+  ret = libusb_bulk_transfer(dev_handle, XVCPICO_WRITE_EP, tx_buffer, header_offset, &actual_length, 1000);
+  if ((ret < 0) || (actual_length != header_offset)) {
+    printf("gpio_pad: usb bulk write failed!\n");
+    return -1;
+  }
+  return 0;
+}
+
+int gpio_recieve(uint32_t n, uint8_t *tdo) {
+  unsigned char *result = usb_buf[USB_BUF_RX];
   int actual_length, ret;
 
   int bytes = (n + 7) / 8;
+  int got = 0;
 
-  do {
+  // A short packet ends a transfer early, keep reading until all of it is in
+  while (got < bytes) {
     // Note: For a full-speed device, a bulk packet is limited to 64 bytes!
     // DirtyJTAG USB -> [32597.543687] usb 3-2.3.1: new full-speed USB device number 81 using xhci_hcd
-    ret = libusb_bulk_transfer(dev_handle, XVCPICO_READ_EP, result, bytes, &actual_length, 2000);
+    ret = libusb_bulk_transfer(dev_handle, XVCPICO_READ_EP, result + got, bytes - got, &actual_length, 2000);
     if (ret < 0) {
       printf("gpio_xfer_full: usb bulk read failed!\n");
-      printf("[Total Bytes] %d, [Return Code] %d [Actual Length] %d\n", bytes, ret, actual_length);
-      return;
+      printf("[Total Bytes] %d, [Return Code] %d [Actual Length] %d\n", bytes, ret, got + actual_length);
+      return -1;
     }
-  } while (actual_length == 0);
-
-  for (int i = 0; i < bytes; i++) {
-    tdo[i] = result[i];
+    got += actual_length;
   }
-  return;
+
+  memcpy(tdo, result, bytes);
+  return 0;
 }
 
+// IN transfer for the small shift fast path, NULL when disabled
+static struct libusb_transfer *small_in;
+
 int device_init() {
   int ret;
   struct libusb_device **devs;
@@ -175,16 +314,39 @@ out:
     return -1;
   }
 
+  // The AXM interface is optional, only "mrd:" and "mwr:" need it
+  ret = libusb_claim_interface(dev_handle, XVCPICO_AXM_INTF);
+  if (ret) {
+    printf("[!] AXM interface unavailable (%s), mrd/mwr disabled\n", libusb_error_name(ret));
+  } else {
+    axm_claimed = 1;
+  }
+
+  if (usb_pool_init()) {
+    printf("[ERROR] failed to allocate usb buffers!\n");
+    libusb_close(dev_handle);
+    libusb_exit(usb_ctx);
+    return -1;
+  }
+  if (usb_pool_dev_mem)
+    printf("Using %zu bytes of usbfs device memory for transfers\n", usb_pool_size);
+  small_in = libusb_alloc_transfer(0);
+
   dev = libusb_get_device(dev_handle);
   int size;
   size = libusb_get_max_iso_packet_size(dev, XVCPICO_WRITE_EP);
 
   // printf("write ep size = %d\n", size);
 
+  ep_size = size;
   return size;  // success
 }
 
 void device_close() {
+  if (small_in)
+    libusb_free_transfer(small_in);
+  small_in = NULL;
+  usb_pool_free();
   if (dev_handle)
     libusb_close(dev_handle);
   if (usb_ctx)
@@ -197,7 +359,7 @@ void device_close() {
 // Command Code -> CMD_WRITE
 int gpio_write(int tck, int tms, int tdi) {
   int actual_length;
-  uint8_t buf[8];
+  uint8_t *buf = usb_buf[USB_BUF_CTRL];
   u_int buffer_idx = 0;
 
   buf[buffer_idx++] = CMD_WRITE;
@@ -214,268 +376,911 @@ int gpio_write(int tck, int tms, int tdi) {
   return 0;
 }
 
-static int verbose = 0;
-
-static int sread(int fd, void *target, int len) {
-  unsigned char *t = target;
-  while (len) {
-    int r = read(fd, t, len);
-    if (r <= 0)
-      return r;
-    t += r;
-    len -= r;
+// AXM transactions (see firmware/axm.c). Every transaction starts with a
+// header packet:
+//   [0]     W/R#
+//   [2:1]   LEN (10bit)
+//   [7:4]   ADDRESS
+//   [63:8]  first 56 bytes of write data
+// Longer writes continue in 64 byte packets. Read data comes back on the
+// AXM IN endpoint in packets of up to 64 bytes.
+// Inverse of the LEN decoding in pmod_task()
+static int axm_len(uint32_t size) {
+  switch (size) {
+    case 1:
+    case 2:
+    case 4:
+      return size;
+    case 8:
+      return 7;
   }
-  return 1;
+  if (size >= 16 && size <= AXM_MAX_BURST)
+    return size - 8;
+  return -1;
 }
 
-static unsigned char buffer[BUFFER_SIZE], result[BUFFER_SIZE / 2];
+static int axm_transfer(_Bool write, uint32_t address, uint8_t *data, uint32_t size) {
+  unsigned char *tx_buffer = usb_buf[USB_BUF_AXM_TX];
+  int actual_length, ret, len;
+  uint32_t done, chunk, header_offset;
 
-int handle_data(int fd, int ep_size) {
-  uint32_t len, nr_bytes;
+  len = axm_len(size);
+  if (len < 0)
+    return -1;
 
+  tx_buffer[0] = write;
+  tx_buffer[1] = len & 0xFF;
+  tx_buffer[2] = (len >> 8) & 0xFF;
+  tx_buffer[3] = 0;
+  tx_buffer[4] = (address >> 0) & 0xFF;
+  tx_buffer[5] = (address >> 8) & 0xFF;
+  tx_buffer[6] = (address >> 16) & 0xFF;
+  tx_buffer[7] = (address >> 24) & 0xFF;
+  header_offset = 8;
+
+  done = 0;
   do {
-    char cmd[16];
-    memset(cmd, 0, 16);
+    chunk = 0;
+    if (write) {
+      chunk = usb_buf_size[USB_BUF_AXM_TX] - header_offset;
+      if (chunk > size - done)
+        chunk = size - done;
+      memcpy(&tx_buffer[header_offset], &data[done], chunk);
+    }
+    ret = libusb_bulk_transfer(dev_handle, XVCPICO_AXM_WRITE_EP, tx_buffer, header_offset + chunk, &actual_length, 1000);
+    if ((ret < 0) || (actual_length != (int)(header_offset + chunk))) {
+      printf("axm_transfer: usb bulk write failed!\n");
+      return -1;
+    }
+    done += chunk;
+    header_offset = 0;
+  } while (done < size && write);
+
+  if (!write) {
+    ret = libusb_bulk_transfer(dev_handle, XVCPICO_AXM_READ_EP, usb_buf[USB_BUF_AXM_RX], size, &actual_length, 2000);
+    if ((ret < 0) || (actual_length != (int)size)) {
+      printf("axm_transfer: usb bulk read failed!\n");
+      printf("[Total Bytes] %d, [Return Code] %d [Actual Length] %d\n", size, ret, actual_length);
+      return -1;
+    }
+    memcpy(data, usb_buf[USB_BUF_AXM_RX], size);
+  }
 
-    if (sread(fd, cmd, 2) != 1)
-      return 1;
+  return 0;
+}
 
-    if (memcmp(cmd, "ge", 2) == 0) {
-      if (sread(fd, cmd, 6) != 1)
-        return 1;
-      memcpy(result, xvcInfo, strlen(xvcInfo));
-      if (write(fd, result, strlen(xvcInfo)) != (ssize_t)strlen(xvcInfo)) {
-        perror("write 1");
-        return 1;
-      }
-      if (verbose) {
-        printf("%u : Received command: 'getinfo'\n", (int)time(NULL));
-        printf("\t Replied with %s\n", xvcInfo);
-      }
-      break;
-    } else if (memcmp(cmd, "se", 2) == 0) {
-      if (sread(fd, cmd, 9) != 1)
-        return 1;
-      memcpy(result, cmd + 5, 4);
-      if (write(fd, result, 4) != 4) {
-        perror("write 2");
-        return 2;
-      }
-      if (verbose) {
-        printf("%u : Received command: 'settck'\n", (int)time(NULL));
-        printf("\t Replied with '%.*s'\n\n", 4, cmd + 5);
-      }
-      break;
-    } else if (memcmp(cmd, "de", 2) == 0) {  // DEBUG CODE
-      if (sread(fd, cmd, 3) != 1)
-        return 1;
-      printf("%u : Received command: 'debug'\n", (int)time(NULL));
-      gpio_write(1, 1, 1);
-      break;
-    } else if (memcmp(cmd, "of", 2) == 0) {  // DEBUG CODE
-      if (sread(fd, cmd, 1) != 1)
-        return 1;
-      printf("%u : Received command: 'off'\n", (int)time(NULL));
-      gpio_write(0, 0, 0);
-      break;
-    } else if (memcmp(cmd, "sh", 2) == 0) {
-      if (sread(fd, cmd, 4) != 1)
-        return 1;
-      if (verbose) {
-        printf("%u : Received command: 'shift'\n", (int)time(NULL));
-      }
+// Split an arbitrary memory access into transactions the AXM bridge
+// supports: naturally aligned 1/2/4/8 byte accesses and word aligned bursts.
+int axm_access(_Bool write, uint32_t address, uint8_t *data, uint32_t size) {
+  if (!axm_claimed || stream_running)
+    return -1;
+  while (size) {
+    uint32_t n;
+
+    if (size >= 16 && (address & 3) == 0) {
+      n = size > AXM_BURST ? AXM_BURST : size;
+      // Leave a remainder that can still be expressed as a burst
+      if (size - n != 0 && size - n < 16)
+        n -= 16;
     } else {
-      fprintf(stderr, "invalid cmd '%s'\n", cmd);
-      return 1;
+      n = 8;
+      while (n > size || (address & (n - 1)))
+        n >>= 1;
     }
+    if (axm_transfer(write, address, data, n))
+      return -1;
+    address += n;
+    data += n;
+    size -= n;
+  }
+  return 0;
+}
 
-    // Handling for -> "shift:<num bits><tms vector><tdi vector>"
-    if (sread(fd, &len, 4) != 1) {
-      fprintf(stderr, "reading length failed\n");
-      return 1;
-    }
+// Gang mode: the firmware broadcasts TCK/TMS/TDI to several identical
+// targets and compares the TDO of targets 1..n-1 against target 0, which is
+// the one the XVC client sees.
+static int gang_targets = 1;
+static unsigned long gang_shifts;
 
-    nr_bytes = (len + 7) / 8;
-    if (nr_bytes * 2 > sizeof(buffer)) {
-      fprintf(stderr, "buffer size exceeded\n");
-      return 1;
+int gpio_gang(int targets) {
+  int actual_length;
+  uint8_t *buf = usb_buf[USB_BUF_CTRL];
+  u_int buffer_idx = 0;
+
+  buf[buffer_idx++] = CMD_GANG;
+  buf[buffer_idx++] = ((1 << targets) - 1) & ~1;
+  buf[buffer_idx++] = CMD_STOP;
+  int ret = libusb_bulk_transfer(dev_handle, XVCPICO_WRITE_EP, buf, buffer_idx, &actual_length, 1000);
+  if (ret < 0) {
+    printf("gpio_gang: usb bulk write failed\n");
+    return -EXIT_FAILURE;
+  }
+
+  gang_targets = targets;
+  return 0;
+}
+
+// Report targets whose TDO differed from target 0 during the last shift.
+// Returns the mask of those targets, -1 on USB errors.
+static int gang_check() {
+  int actual_length;
+  uint8_t *buf = usb_buf[USB_BUF_CTRL];
+  uint8_t status[1 + 4 * GANG_MAX];
+
+  buf[0] = CMD_GANG_STATUS;
+  buf[1] = CMD_STOP;
+  int ret = libusb_bulk_transfer(dev_handle, XVCPICO_WRITE_EP, buf, 2, &actual_length, 1000);
+  if (ret < 0) {
+    printf("gang_check: usb bulk write failed\n");
+    return -EXIT_FAILURE;
+  }
+  if (gpio_recieve(sizeof(status) * 8, status))
+    return -1;
+
+  gang_shifts++;
+  for (int t = 1; t < gang_targets; t++) {
+    if (status[0] & (1 << t)) {
+      uint32_t bit = status[1 + 4 * t] | status[2 + 4 * t] << 8 | status[3 + 4 * t] << 16 | (uint32_t)status[4 + 4 * t] << 24;
+      fprintf(stderr, "gang: target %d TDO differs from target 0 at bit %u of shift %lu\n", t, bit, gang_shifts);
     }
+  }
+  return status[0];
+}
+
+// Vendor requests on the JTAG interface, see firmware/jtag_usb.h
+#define XVCPICO_REQ_SELFTEST 0x01
+#define XVCPICO_REQ_SELFTEST_RESULT 0x02
+#define XVCPICO_REQ_ECHO 0x03
+#define XVCPICO_REQ_STORE_INFO 0x04
+#define XVCPICO_REQ_OUT (LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_INTERFACE)
+#define XVCPICO_REQ_IN (LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_INTERFACE)
+
+#define SELFTEST_MBIT 16
+#define ECHO_BYTES (8 * 1024 * 1024)
+
+static double seconds_since(const struct timespec *t0) {
+  struct timespec t1;
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  return (t1.tv_sec - t0->tv_sec) + (t1.tv_nsec - t0->tv_nsec) / 1e9;
+}
 
-    if (sread(fd, buffer, nr_bytes * 2) != 1) {
-      fprintf(stderr, "reading data failed\n");
+// Shift a pattern on the Pico alone, no USB traffic per bit. Measures the
+// bare shift engine and, with TDI wired to TDO, checks the wiring.
+static int selftest_shift(int loop) {
+  uint8_t r[16];
+  uint32_t bits, us, errors;
+  int ret;
+
+  ret = libusb_control_transfer(dev_handle, XVCPICO_REQ_OUT, XVCPICO_REQ_SELFTEST, SELFTEST_MBIT, XVCPICO_INTF, NULL,
+                                0, 1000);
+  if (ret < 0) {
+    fprintf(stderr, "self-test: not supported by the firmware (%s)\n", libusb_error_name(ret));
+    return 1;
+  }
+  do {
+    usleep(50000);
+    ret = libusb_control_transfer(dev_handle, XVCPICO_REQ_IN, XVCPICO_REQ_SELFTEST_RESULT, 0, XVCPICO_INTF, r,
+                                  sizeof(r), 1000);
+    if (ret != sizeof(r)) {
+      fprintf(stderr, "self-test: reading the result failed (%s)\n", libusb_error_name(ret));
       return 1;
     }
-    memset(result, 0, nr_bytes);
+  } while (r[0] != 2);  // JTAG_SELFTEST_DONE
+
+  bits = r[4] | r[5] << 8 | r[6] << 16 | (uint32_t)r[7] << 24;
+  us = r[8] | r[9] << 8 | r[10] << 16 | (uint32_t)r[11] << 24;
+  errors = r[12] | r[13] << 8 | r[14] << 16 | (uint32_t)r[15] << 24;
+  printf("shift engine: %u bits in %.3f s (%.3f Mbit/s)\n", bits, us / 1e6, us ? (double)bits / us : 0.0);
+  if (!loop)
+    return 0;
+  printf("loopback: %u of %u bits with TDO != TDI\n", errors, bits);
+  return errors ? 1 : 0;
+}
 
-    if (verbose) {
-      printf("\tNumber of Bits  : %d\n", len);
-      printf("\tNumber of Bytes : %d \n", nr_bytes);
-      printf("\n");
+// Raw USB throughput: the Pico sends every OUT packet straight back
+static int selftest_echo(void) {
+  unsigned char *tx = usb_buf[USB_BUF_TX], *rx = usb_buf[USB_BUF_RX];
+  const int chunk = 512;  // fits into the Pico's RX and TX rings
+  struct timespec t0;
+  unsigned long bad = 0;
+  uint32_t x = 1;
+  double t;
+  int ret, actual;
+
+  ret = libusb_control_transfer(dev_handle, XVCPICO_REQ_OUT, XVCPICO_REQ_ECHO, 1, XVCPICO_INTF, NULL, 0, 1000);
+  if (ret < 0) {
+    fprintf(stderr, "echo: not supported by the firmware (%s)\n", libusb_error_name(ret));
+    return 1;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (int done = 0; done < ECHO_BYTES; done += chunk) {
+    for (int i = 0; i < chunk; i++)
+      tx[i] = x++ * 0x9E;
+    ret = libusb_bulk_transfer(dev_handle, XVCPICO_WRITE_EP, tx, chunk, &actual, 1000);
+    if (ret < 0 || actual != chunk) {
+      fprintf(stderr, "echo: usb bulk write failed (%s)\n", libusb_error_name(ret));
+      break;
     }
-
-    // Note
-    gpio_write(0, 1, 1);
-
-    int bytesLeft = nr_bytes;
-    int bitsLeft = len;
-    int byteIndex = 0;
-    int byteIndexr = 0;
-    uint8_t tdi[256], tms[256], tdo[256];
-    _Bool header;
-    int size;
-    int sizer = 0;
-
-    header = 1;
-
-    while (bytesLeft > 0) {
-      tms[0] = 0;
-      tdi[0] = 0;
-      tdo[0] = 0;
-      if (header) {
-        size = ep_size / 2 - 4;
-      } else {
-        size = ep_size / 2;
-      }
-      if (bytesLeft >= size) {
-        memcpy(tms, &buffer[byteIndex], size);
-        memcpy(tdi, &buffer[byteIndex + nr_bytes], size);
-        gpio_send(header, len, size * 8, tms, tdi);
-        if (!header) {
-          gpio_recieve(sizer * 8, tdo);
-          memcpy(&result[byteIndexr], tdo, sizer);
-        }
-        sizer = size;
-        byteIndexr = byteIndex;
-        bytesLeft -= size;
-        bitsLeft -= size * 8;
-        byteIndex += size;
-        header = 0;
-      } else {
-        memcpy(tms, &buffer[byteIndex], bytesLeft);
-        memcpy(tdi, &buffer[byteIndex + nr_bytes], bytesLeft);
-        gpio_send(header, len, bitsLeft, tms, tdi);
-        if (!header) {
-          gpio_recieve(sizer * 8, tdo);
-          memcpy(&result[byteIndexr], tdo, sizer);
-        }
-        gpio_recieve(bitsLeft, tdo);
-        memcpy(&result[byteIndex], tdo, bytesLeft);
-        break;
-      }
+    ret = libusb_bulk_transfer(dev_handle, XVCPICO_READ_EP, rx, chunk, &actual, 1000);
+    if (ret < 0 || actual != chunk) {
+      fprintf(stderr, "echo: usb bulk read failed (%s)\n", libusb_error_name(ret));
+      break;
     }
+    for (int i = 0; i < chunk; i++)
+      bad += rx[i] != tx[i];
+  }
+  t = seconds_since(&t0);
+  libusb_control_transfer(dev_handle, XVCPICO_REQ_OUT, XVCPICO_REQ_ECHO, 0, XVCPICO_INTF, NULL, 0, 1000);
+  if (ret < 0 || actual != chunk)
+    return 1;
 
-    if (bytesLeft == 0) {
-      gpio_recieve(sizer * 8, tdo);
-      memcpy(&result[byteIndexr], tdo, sizer);
-    }
+  printf("usb echo: %d bytes each way in %.3f s (%.3f MB/s), %lu bytes differed\n", ECHO_BYTES, t,
+         ECHO_BYTES / t / 1e6, bad);
+  return bad ? 1 : 0;
+}
 
-    gpio_write(0, 1, 0);
+int selftest(const char *mode) {
+  if (strcmp(mode, "shift") == 0)
+    return selftest_shift(0);
+  if (strcmp(mode, "loop") == 0)
+    return selftest_shift(1);
+  if (strcmp(mode, "echo") == 0)
+    return selftest_echo();
+  fprintf(stderr, "unknown self-test '%s', use shift, loop or echo\n", mode);
+  return 1;
+}
+
+// Image store, see firmware/store.h
+
+int pico_store_info(struct pico_store_info *info) {
+  uint8_t r[24];
+  int ret;
+
+  ret = libusb_control_transfer(dev_handle, XVCPICO_REQ_IN, XVCPICO_REQ_STORE_INFO, 0, XVCPICO_INTF, r, sizeof(r),
+                                5000);
+  if (ret != sizeof(r)) {
+    fprintf(stderr, "store: not supported by the firmware (%s)\n", libusb_error_name(ret));
+    return -1;
+  }
+  info->valid = r[0];
+  info->flags = r[1];
+  info->replaying = r[2];
+  info->size = r[4] | r[5] << 8 | r[6] << 16 | (uint32_t)r[7] << 24;
+  info->hash = 0;
+  for (int i = 0; i < 8; i++)
+    info->hash |= (uint64_t)r[8 + i] << (8 * i);
+  info->capacity = r[16] | r[17] << 8 | r[18] << 16 | (uint32_t)r[19] << 24;
+  return 0;
+}
 
-    if (write(fd, result, nr_bytes) != nr_bytes) {
-      perror("write 3: Reduce BUFFER_SIZE in xvcpico.c");
-      return 3;
+void pico_replay_wait(void) {
+  uint8_t r[24];
+  int waited = 0;
+
+  // Quietly gives up on firmware without the request
+  while (libusb_control_transfer(dev_handle, XVCPICO_REQ_IN, XVCPICO_REQ_STORE_INFO, 0, XVCPICO_INTF, r, sizeof(r),
+                                 1000) == sizeof(r) && r[2]) {
+    if (!waited++)
+      fprintf(stderr, "Waiting for the Pico to finish playing its stored image\n");
+    usleep(100000);
+  }
+}
+
+// Send one command packet and wait for its status byte
+static int store_command(int len, unsigned int timeout) {
+  int actual_length, ret;
+
+  ret = libusb_bulk_transfer(dev_handle, XVCPICO_WRITE_EP, usb_buf[USB_BUF_TX], len, &actual_length, timeout);
+  if (ret < 0 || actual_length != len) {
+    printf("store: usb bulk write failed!\n");
+    return -1;
+  }
+  ret = libusb_bulk_transfer(dev_handle, XVCPICO_READ_EP, usb_buf[USB_BUF_RX], ep_size, &actual_length, timeout);
+  if (ret < 0 || actual_length != 1) {
+    printf("store: usb bulk read failed!\n");
+    return -1;
+  }
+  return usb_buf[USB_BUF_RX][0];
+}
+
+int pico_store(const uint8_t *image, uint32_t size, uint64_t hash, int flags) {
+  unsigned char *tx_buffer = usb_buf[USB_BUF_TX];
+  int actual_length, ret;
+
+  tx_buffer[0] = CMD_STORE_BEGIN;
+  for (int i = 0; i < 4; i++)
+    tx_buffer[1 + i] = size >> (8 * i);
+  tx_buffer[5] = flags;
+  tx_buffer[6] = CMD_STOP;
+  if (store_command(7, 5000) != 0) {
+    fprintf(stderr, "store: the Pico refused the image\n");
+    return -1;
+  }
+
+  // The Pico erases sectors as the data reaches them, writes may stall
+  for (uint32_t pos = 0; pos < size;) {
+    uint32_t n = size - pos < (uint32_t)ep_size - 2 ? size - pos : (uint32_t)ep_size - 2;
+    tx_buffer[0] = CMD_STORE_DATA;
+    tx_buffer[1] = n;
+    memcpy(&tx_buffer[2], &image[pos], n);
+    if (n < (uint32_t)ep_size - 2)
+      tx_buffer[2 + n] = CMD_STOP;
+    ret = libusb_bulk_transfer(dev_handle, XVCPICO_WRITE_EP, tx_buffer, 2 + n + (n < (uint32_t)ep_size - 2),
+                               &actual_length, 5000);
+    if (ret < 0) {
+      printf("store: usb bulk write failed!\n");
+      return -1;
     }
+    pos += n;
+  }
 
-  } while (1);
-  /* Note: Need to fix JTAG state updates, until then no exit is allowed */
+  tx_buffer[0] = CMD_STORE_END;
+  for (int i = 0; i < 8; i++)
+    tx_buffer[1 + i] = hash >> (8 * i);
+  tx_buffer[9] = CMD_STOP;
+  if (store_command(10, 30000) != 0) {
+    fprintf(stderr, "store: the image in flash does not match\n");
+    return -1;
+  }
   return 0;
 }
 
-int main() {
-  int i;
-  int s;
-  struct sockaddr_in address;
+int pico_replay(uint32_t *bit) {
+  unsigned char *tx_buffer = usb_buf[USB_BUF_TX];
+  unsigned char *result = usb_buf[USB_BUF_RX];
+  int actual_length, ret;
 
-  // Init
-  sprintf(xvcInfo, "xvcServer_v1.0:%d\n", BUFFER_SIZE);
-  int ep_size = device_init();
-  if (ep_size < 0) {
+  tx_buffer[0] = CMD_REPLAY;
+  tx_buffer[1] = CMD_STOP;
+  ret = libusb_bulk_transfer(dev_handle, XVCPICO_WRITE_EP, tx_buffer, 2, &actual_length, 1000);
+  if (ret < 0) {
+    printf("replay: usb bulk write failed!\n");
+    return -1;
+  }
+  ret = libusb_bulk_transfer(dev_handle, XVCPICO_READ_EP, result, ep_size, &actual_length, 600000);
+  if (ret < 0 || actual_length != 5) {
+    printf("replay: usb bulk read failed!\n");
+    return -1;
+  }
+  *bit = result[1] | result[2] << 8 | result[3] << 16 | (uint32_t)result[4] << 24;
+  if (result[0] == 2) {
+    fprintf(stderr, "replay: no image stored\n");
     return -1;
   }
-  fprintf(stderr, "NB: ep_size => %d\n", ep_size);
-  fprintf(stderr, "XVCPI is listening now with BUFFER_SIZE => %d!\n", BUFFER_SIZE/2);
+  if (result[0] == 3)
+    return 2;  // unknown operation
+  return result[0];
+}
 
-  s = socket(AF_INET, SOCK_STREAM, 0);
-  if (s < 0) {
-    perror("socket");
-    device_close();
-    return 1;
+// SPI flash access, see firmware/spiflash.h. Commands are packed into
+// packets and only sent when the next one does not fit, or when an answer is
+// needed.
+#define SPI_ON 0x01
+#define SPI_OFF 0x02
+#define SPI_WRITE 0x03
+#define SPI_READ 0x04
+#define SPI_WAIT 0x05
+#define SPI_KEEP_CS 0x01
+
+static int spi_fill;     // bytes queued in usb_buf[USB_BUF_TX]
+static int spi_waiting;  // SPI_WAIT answers not read yet
+
+static int spi_flush(void) {
+  unsigned char *tx_buffer = usb_buf[USB_BUF_TX];
+  int actual_length, ret;
+
+  if (!spi_fill)
+    return 0;
+  if (spi_fill < ep_size)
+    tx_buffer[spi_fill++] = CMD_STOP;
+  // The Pico stops reading packets while the flash erases or programs
+  ret = libusb_bulk_transfer(dev_handle, XVCPICO_WRITE_EP, tx_buffer, spi_fill, &actual_length, 10000);
+  spi_fill = 0;
+  if (ret < 0) {
+    printf("spi: usb bulk write failed!\n");
+    return -1;
   }
-  i = 1;
-  setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &i, sizeof i);
-  address.sin_addr.s_addr = INADDR_ANY;
-  address.sin_port = htons(2542);
-  address.sin_family = AF_INET;
+  return 0;
+}
 
-  if (bind(s, (struct sockaddr *)&address, sizeof(address)) < 0) {
-    perror("bind");
-    device_close();
-    return 1;
+static int spi_queue(const uint8_t *cmd, int len, const uint8_t *data, int n) {
+  if (spi_fill + len + n > ep_size && spi_flush())
+    return -1;
+  memcpy(&usb_buf[USB_BUF_TX][spi_fill], cmd, len);
+  memcpy(&usb_buf[USB_BUF_TX][spi_fill + len], data, n);
+  spi_fill += len + n;
+  return 0;
+}
+
+int pico_spi(int on) {
+  const uint8_t cmd[2] = { CMD_SPI, on ? SPI_ON : SPI_OFF };
+
+  if (pico_spi_sync() < 0 || spi_queue(cmd, 2, NULL, 0) || spi_flush())
+    return -1;
+  return 0;
+}
+
+int pico_spi_write(const uint8_t *data, uint32_t len, int keep_cs) {
+  const uint32_t max = ep_size - 4;
+
+  while (len) {
+    uint32_t n = len < max ? len : max;
+    uint8_t cmd[4] = { CMD_SPI, SPI_WRITE, keep_cs || n < len ? SPI_KEEP_CS : 0, n };
+    if (spi_queue(cmd, 4, data, n))
+      return -1;
+    data += n;
+    len -= n;
   }
+  return 0;
+}
 
-  if (listen(s, 0) < 0) {
-    perror("listen");
-    device_close();
-    return 1;
+int pico_spi_read(uint8_t *data, uint32_t len, int keep_cs) {
+  int actual_length, ret;
+
+  if (pico_spi_sync())
+    return -1;
+  while (len) {
+    uint32_t n = len < 0xFFFF ? len : 0xFFFF;
+    uint8_t cmd[5] = { CMD_SPI, SPI_READ, keep_cs || n < len ? SPI_KEEP_CS : 0, n & 0xFF, n >> 8 };
+    if (spi_queue(cmd, 5, NULL, 0) || spi_flush())
+      return -1;
+    ret = libusb_bulk_transfer(dev_handle, XVCPICO_READ_EP, data, n, &actual_length, 5000);
+    if (ret < 0 || actual_length != (int)n) {
+      printf("spi: usb bulk read failed!\n");
+      return -1;
+    }
+    data += n;
+    len -= n;
   }
+  return 0;
+}
+
+// Read SPI_WAIT answers until no more than `lag` are outstanding. Each one
+// takes a packet of the Pico's TX ring, so only a few may be left unread.
+static int spi_collect(int lag) {
+  int actual_length, ret, busy = 0;
+
+  if (spi_waiting > lag && spi_flush())
+    return -1;
+  while (spi_waiting > lag) {
+    ret = libusb_bulk_transfer(dev_handle, XVCPICO_READ_EP, usb_buf[USB_BUF_RX], ep_size, &actual_length, 10000);
+    if (ret < 0 || actual_length != 1) {
+      printf("spi: usb bulk read failed!\n");
+      spi_waiting = 0;
+      return -1;
+    }
+    busy |= usb_buf[USB_BUF_RX][0] & 1;  // WIP, the flash timed out
+    spi_waiting--;
+  }
+  return busy;
+}
+
+int pico_spi_wait(int lag) {
+  static const uint8_t cmd[2] = { CMD_SPI, SPI_WAIT };
+
+  if (spi_queue(cmd, 2, NULL, 0))
+    return -1;
+  spi_waiting++;
+  return spi_collect(lag);
+}
 
-  fd_set conn;
-  int maxfd = 0;
-  FD_ZERO(&conn);
-  FD_SET(s, &conn);
-  maxfd = s;
+int pico_spi_sync(void) {
+  int ret = spi_collect(0);
 
-  while (1) {
-    fd_set read = conn, except = conn;
-    int fd;
+  if (spi_flush())
+    return -1;
+  return ret;
+}
+
+// PMOD stream, vendor requests on the AXM interface (firmware/stream.h)
+#define XVCPICO_REQ_STREAM 0x01
+#define XVCPICO_REQ_STREAM_STATUS 0x02
+
+// Bulk IN transfers kept in flight, so the Pico always has somewhere to send
+// to and the data never waits for a round trip
+#define STREAM_XFERS 8
+#define STREAM_XFER_SIZE (16 * 1024)
+
+struct stream_ctx {
+  int (*sink)(const uint8_t *data, int len, void *user);
+  void *user;
+  int in_flight;
+  int stopping;
+  int failed;
+};
+
+static int stream_status(struct pico_stream_status *status) {
+  uint8_t r[16];
+  int ret;
+
+  ret = libusb_control_transfer(dev_handle, XVCPICO_REQ_IN, XVCPICO_REQ_STREAM_STATUS, 0, XVCPICO_AXM_INTF, r,
+                                sizeof(r), 1000);
+  if (ret != sizeof(r))
+    return -1;
+  status->running = r[0];
+  status->khz = r[4] | r[5] << 8 | r[6] << 16 | (uint32_t)r[7] << 24;
+  status->bytes = r[8] | r[9] << 8 | r[10] << 16 | (uint32_t)r[11] << 24;
+  status->stalls = r[12] | r[13] << 8 | r[14] << 16 | (uint32_t)r[15] << 24;
+  return 0;
+}
 
-    if (select(maxfd + 1, &read, 0, &except, 0) < 0) {
-      perror("select");
+// Transfers on one endpoint complete in the order they were submitted, so
+// the sink sees the data in order
+static void LIBUSB_CALL stream_done(struct libusb_transfer *transfer) {
+  struct stream_ctx *ctx = transfer->user_data;
+
+  ctx->in_flight--;
+  if (transfer->actual_length > 0 && !ctx->failed &&
+      ctx->sink(transfer->buffer, transfer->actual_length, ctx->user))
+    ctx->failed = ctx->stopping = 1;
+  if (transfer->status != LIBUSB_TRANSFER_COMPLETED && transfer->status != LIBUSB_TRANSFER_CANCELLED) {
+    if (!ctx->stopping)
+      fprintf(stderr, "stream: usb bulk read failed (status %d)\n", transfer->status);
+    ctx->failed = ctx->stopping = 1;
+  }
+  if (ctx->stopping)
+    return;
+  if (libusb_submit_transfer(transfer) < 0)
+    ctx->failed = ctx->stopping = 1;
+  else
+    ctx->in_flight++;
+}
+
+int pico_stream(unsigned khz, int (*sink)(const uint8_t *data, int len, void *user), void *user,
+                volatile int *stop, struct pico_stream_status *status) {
+  struct stream_ctx ctx = { .sink = sink, .user = user };
+  struct libusb_transfer *xfers[STREAM_XFERS] = { NULL };
+  uint8_t *bufs;
+  int ret, actual;
+
+  if (!axm_claimed) {
+    fprintf(stderr, "stream: the AXM interface is unavailable\n");
+    return -1;
+  }
+  if (khz < 1 || khz > 0xFFFF)
+    return -1;
+  bufs = malloc(STREAM_XFERS * STREAM_XFER_SIZE);
+  if (!bufs)
+    return -1;
+  ret = libusb_control_transfer(dev_handle, XVCPICO_REQ_OUT, XVCPICO_REQ_STREAM, khz, XVCPICO_AXM_INTF, NULL, 0,
+                                1000);
+  if (ret < 0) {
+    fprintf(stderr, "stream: not supported by the firmware (%s)\n", libusb_error_name(ret));
+    free(bufs);
+    return -1;
+  }
+  stream_running = 1;
+  // The firmware starts it from its main loop
+  for (int i = 0; i < 100 && stream_status(status) == 0 && !status->running; i++)
+    usleep(10000);
+
+  for (int i = 0; i < STREAM_XFERS; i++) {
+    xfers[i] = libusb_alloc_transfer(0);
+    if (!xfers[i])
       break;
+    libusb_fill_bulk_transfer(xfers[i], dev_handle, XVCPICO_AXM_READ_EP, bufs + i * STREAM_XFER_SIZE,
+                              STREAM_XFER_SIZE, stream_done, &ctx, 0);
+    if (libusb_submit_transfer(xfers[i]) < 0)
+      break;
+    ctx.in_flight++;
+  }
+  if (!ctx.in_flight)
+    ctx.failed = ctx.stopping = 1;
+
+  while (!ctx.stopping && !*stop) {
+    struct timeval tv = { 0, 100000 };
+    libusb_handle_events_timeout_completed(usb_ctx, &tv, NULL);
+  }
+  ctx.stopping = 1;
+
+  libusb_control_transfer(dev_handle, XVCPICO_REQ_OUT, XVCPICO_REQ_STREAM, 0, XVCPICO_AXM_INTF, NULL, 0, 1000);
+  for (int i = 0; i < STREAM_XFERS && xfers[i]; i++)
+    libusb_cancel_transfer(xfers[i]);
+  while (ctx.in_flight) {
+    struct timeval tv = { 0, 100000 };
+    libusb_handle_events_timeout_completed(usb_ctx, &tv, NULL);
+  }
+  // Whatever was still on its way, the AXM endpoint must be empty afterwards
+  while (libusb_bulk_transfer(dev_handle, XVCPICO_AXM_READ_EP, bufs, STREAM_XFER_SIZE, &actual, 100) == 0 &&
+         actual > 0) {
+    if (!ctx.failed && sink(bufs, actual, user))
+      ctx.failed = 1;
+  }
+  stream_running = 0;
+
+  for (int i = 0; i < STREAM_XFERS; i++) {
+    if (xfers[i])
+      libusb_free_transfer(xfers[i]);
+  }
+  free(bufs);
+  if (stream_status(status))
+    return -1;
+  return ctx.failed ? -1 : 0;
+}
+
+// The firmware packs TDO back to back and only sends a short packet at the
+// end of a shift, so whole packets of TDO that are already due can be read
+// in one transfer. Reading once TDO_WINDOW bytes are outstanding keeps the
+// backlog well below the firmware's TX ring (8 x 64 bytes).
+#define TDO_WINDOW 256
+
+// Set once the firmware is known to coalesce TDO. Older firmware answers
+// every OUT packet with a short packet of its own, which is read right away.
+static int coalescing;
+
+// Runs of identical TMS/TDI bytes of at least this length are clocked by the
+// firmware (CMD_PAD) instead of being sent as pairs. Shorter runs would not
+// save a packet.
+#define PAD_MIN_BYTES 64
+// How far ahead runs are looked for, this also bounds a literal segment
+#define SEGMENT_BYTES 4096
+
+// Set once the firmware is known to handle CMD_PAD
+static int padding;
+
+static uint32_t pad_run(const uint8_t *tms, const uint8_t *tdi, uint32_t from, uint32_t to) {
+  uint32_t i = from;
+
+  if ((tms[from] != 0x00 && tms[from] != 0xFF) || (tdi[from] != 0x00 && tdi[from] != 0xFF))
+    return 0;
+  while (i < to && tms[i] == tms[from] && tdi[i] == tdi[from])
+    i++;
+  return i - from;
+}
+
+// Read whole packets of TDO that are due, see TDO_WINDOW
+static int tdo_catch_up(uint32_t sent, uint32_t *received, uint8_t *tdo, struct shift_io *io) {
+  if (!coalescing) {
+    if (sent > *received) {
+      if (gpio_recieve((sent - *received) * 8, &tdo[*received]))
+        return -1;
+      *received = sent;
+      if (io && io->tdo_ready)
+        io->tdo_ready(io, *received);
     }
+    return 0;
+  }
+  while (sent - *received >= TDO_WINDOW) {
+    uint32_t n = (sent - *received) & ~(uint32_t)(ep_size - 1);
+    if (n > TDO_WINDOW)
+      n = TDO_WINDOW;
+    if (gpio_recieve(n * 8, &tdo[*received]))
+      return -1;
+    *received += n;
+    if (io && io->tdo_ready)
+      io->tdo_ready(io, *received);
+  }
+  return 0;
+}
 
-    for (fd = 0; fd <= maxfd; ++fd) {
-      if (FD_ISSET(fd, &read)) {
-        if (fd == s) {
-          int newfd;
-          socklen_t nsize = sizeof(address);
-
-          newfd = accept(s, (struct sockaddr *)&address, &nsize);
-          if (verbose)
-            printf("connection accepted - fd %d\n", newfd);
-          if (newfd < 0) {
-            perror("accept");
-          } else {
-            int flag = 1;
-            int optResult = setsockopt(newfd, IPPROTO_TCP, TCP_NODELAY, (char *)&flag, sizeof(int));
-            if (optResult < 0)
-              perror("TCP_NODELAY error");
-            if (newfd > maxfd) {
-              maxfd = newfd;
-            }
-            FD_SET(newfd, &conn);
-          }
-        } else if (handle_data(fd, ep_size)) {
-          if (verbose)
-            printf("connection closed - fd %d\n", fd);
-          close(fd);
-          FD_CLR(fd, &conn);
-        }
-      } else if (FD_ISSET(fd, &except)) {
-        if (verbose)
-          printf("connection aborted - fd %d\n", fd);
-        close(fd);
-        FD_CLR(fd, &conn);
-        if (fd == s)
-          break;
+int jtag_shift(uint32_t len, const uint8_t *tms, const uint8_t *tdi, uint8_t *tdo, struct shift_io *io) {
+  uint32_t nr_bytes = (len + 7) / 8;
+  uint32_t full = len / 8;  // pads only cover whole bytes
+  uint32_t sent = 0;
+  uint32_t received = 0;
+  uint32_t size;
+
+  // The shift goes out as segments: literal TMS/TDI (CMD_XFER) and runs
+  // the firmware pads itself (CMD_PAD). TDO comes back as one stream either
+  // way, only the last segment flushes it.
+  while (sent < nr_bytes) {
+    uint32_t window = sent + SEGMENT_BYTES < nr_bytes ? sent + SEGMENT_BYTES : nr_bytes;
+    uint32_t limit = window < full ? window : full;
+    uint32_t end, bits;
+
+    if (padding && sent < limit) {
+      if (io && io->need_tdi)
+        io->need_tdi(io, window);
+      uint32_t run = pad_run(tms, tdi, sent, limit);
+      if (run >= PAD_MIN_BYTES) {
+        if (gpio_pad(run * 8, tms[sent], tdi[sent], sent + run < nr_bytes))
+          return -1;
+        sent += run;
+        if (tdo_catch_up(sent, &received, tdo, io))
+          return -1;
+        continue;
       }
     }
+
+    // Literal segment, up to the next run worth padding
+    end = sent + 1;
+    while (end < window && !(padding && end < limit && pad_run(tms, tdi, end, limit) >= PAD_MIN_BYTES))
+      end++;
+    bits = end == nr_bytes ? len - sent * 8 : (end - sent) * 8;
+
+    for (uint32_t pos = sent; pos < end; pos += size) {
+      size = pos == sent ? ep_size / 2 - 4 : ep_size / 2;
+      if (size > end - pos)
+        size = end - pos;
+      if (io && io->need_tdi)
+        io->need_tdi(io, pos + size);
+      if (gpio_send(pos == sent, bits, pos + size == end ? bits - (pos - sent) * 8 : size * 8, &tms[pos], &tdi[pos],
+                    end < nr_bytes) ||
+          tdo_catch_up(pos + size, &received, tdo, io))
+        return -1;
+    }
+    sent = end;
+  }
+
+  if (received < nr_bytes) {
+    if (gpio_recieve((nr_bytes - received) * 8, &tdo[received]))
+      return -1;
+    if (io && io->tdo_ready)
+      io->tdo_ready(io, nr_bytes);
+  }
+  return 0;
+}
+
+// Throw away TDO that arrives after a small shift was given up on, so the
+// next shift does not take it for its own. The firmware's TX ring holds 8
+// packets, more than that is not waiting.
+static void tdo_drain(void) {
+  int actual_length;
+
+  for (int i = 0; i < 8; i++) {
+    if (libusb_bulk_transfer(dev_handle, XVCPICO_READ_EP, usb_buf[USB_BUF_RX], ep_size, &actual_length, 100) < 0)
+      break;
+  }
+}
+
+static void LIBUSB_CALL small_in_done(struct libusb_transfer *transfer) {
+  *(int *)transfer->user_data = 1;
+}
+
+// One OUT packet with pin setup, TMS/TDI and teardown, one IN packet with
+// TDO. The IN transfer is submitted before the OUT one so the host controller
+// is already polling for the answer when the Pico sends it.
+static int jtag_shift_small(uint32_t len, const uint8_t *tms, const uint8_t *tdi, uint8_t *tdo) {
+  unsigned char *tx_buffer = usb_buf[USB_BUF_TX];
+  uint32_t bytes = (len + 7) / 8;
+  int actual_length, ret, completed = 0, header_offset = 0;
+
+  tx_buffer[header_offset++] = CMD_SHIFT_SMALL;
+  tx_buffer[header_offset++] = len;
+  for (uint32_t i = 0; i < bytes; i++) {
+    tx_buffer[header_offset++] = tms[i];
+    tx_buffer[header_offset++] = tdi[i];
   }
+  if (header_offset < ep_size)
+    tx_buffer[header_offset++] = CMD_STOP;
 
-  device_close();
+  libusb_fill_bulk_transfer(small_in, dev_handle, XVCPICO_READ_EP, usb_buf[USB_BUF_RX], bytes, small_in_done,
+                            &completed, 1000);
+  if (libusb_submit_transfer(small_in) < 0)
+    return -1;
+
+  ret = libusb_bulk_transfer(dev_handle, XVCPICO_WRITE_EP, tx_buffer, header_offset, &actual_length, 1000);
+  if ((ret < 0) || (actual_length != header_offset)) {
+    printf("jtag_shift_small: usb bulk write failed!\n");
+    libusb_cancel_transfer(small_in);
+  }
+  // The transfer must be finished (or cancelled) before it can be reused
+  while (!completed)
+    libusb_handle_events_completed(usb_ctx, &completed);
+  if (small_in->status != LIBUSB_TRANSFER_COMPLETED || small_in->actual_length != (int)bytes) {
+    if (small_in->status == LIBUSB_TRANSFER_STALL)
+      libusb_clear_halt(dev_handle, XVCPICO_READ_EP);
+    tdo_drain();
+    return -1;
+  }
+
+  memcpy(tdo, usb_buf[USB_BUF_RX], bytes);
   return 0;
 }
 
+// Walk every TAP to Run-Test/Idle through the small shift path. Firmware
+// that does not answer it predates CMD_SHIFT_SMALL, CMD_PAD and TDO
+// coalescing, so none of them is used with it.
+void tap_reset_probe(void) {
+  const uint8_t tms = 0x1F, tdi = 0xFF;
+  uint8_t tdo;
+
+  if (small_in && jtag_shift_small(6, &tms, &tdi, &tdo) == 0) {
+    padding = 1;
+    coalescing = 1;
+    return;
+  }
+  fprintf(stderr, "Old firmware, small shifts, padding and TDO coalescing are disabled\n");
+  if (small_in)
+    libusb_free_transfer(small_in);
+  small_in = NULL;
+  gpio_write(0, 1, 1);
+  jtag_shift(6, &tms, &tdi, &tdo, NULL);
+  gpio_write(0, 1, 0);
+}
+
+int jtag_verify(uint32_t len, const uint8_t *tms, const uint8_t *tdi, const uint8_t *exp, const uint8_t *mask,
+                uint32_t *first) {
+  uint32_t nr_bytes = (len + 7) / 8;
+  uint32_t sent = 0;
+  uint32_t size;
+  uint8_t status[5];
+  _Bool header = 1;
+
+  // Nothing comes back until the end, so the OUT side just streams
+  while (sent < nr_bytes) {
+    if (header) {
+      size = (ep_size - 5) / 4;
+    } else {
+      size = ep_size / 4;
+    }
+    if (size > nr_bytes - sent)
+      size = nr_bytes - sent;
+
+    if (gpio_send_verify(header, len, sent + size == nr_bytes ? len - sent * 8 : size * 8, &tms[sent], &tdi[sent],
+                         &exp[sent], &mask[sent]))
+      return -1;
+    sent += size;
+    header = 0;
+  }
+
+  memset(status, 0, sizeof(status));
+  if (gpio_recieve(sizeof(status) * 8, status))
+    return -1;
+  *first = status[1] | status[2] << 8 | status[3] << 16 | (uint32_t)status[4] << 24;
+  return status[0] ? 1 : 0;
+}
+
+int xvc_verify(uint32_t len, const uint8_t *tms, const uint8_t *tdi, const uint8_t *exp, const uint8_t *mask,
+               uint32_t *first) {
+  uint64_t t0 = trace_enabled ? trace_now() : 0;
+  int ret;
+
+  gpio_write(0, 1, 1);
+
+  ret = jtag_verify(len, tms, tdi, exp, mask, first);
+
+  gpio_write(0, 1, 0);
+
+  if (gang_targets > 1 && gang_check() < 0)
+    ret = -1;
+  if (trace_enabled) {
+    trace_shift(TRACE_KIND_VERIFY, len, tms, tdi, NULL, t0, trace_now());
+    trace_poll();
+  }
+  return ret;
+}
+
+int xvc_shift(uint32_t len, const uint8_t *tms, const uint8_t *tdi, uint8_t *tdo, struct shift_io *io) {
+  uint64_t t0 = trace_enabled ? trace_now() : 0;
+  uint32_t nr_bytes = (len + 7) / 8;
+  int ret = 0;
+
+  // ILA/VIO polling is mostly tiny shifts, those take one round trip
+  if (small_in && len > 0 && len <= SMALL_SHIFT_BITS && gang_targets == 1) {
+    if (io && io->need_tdi)
+      io->need_tdi(io, nr_bytes);
+    // Old firmware was ruled out by tap_reset_probe(). The bits may well
+    // have been clocked already, so they are not shifted again.
+    if (jtag_shift_small(len, tms, tdi, tdo) < 0) {
+      fprintf(stderr, "jtag_shift_small: usb transfer failed!\n");
+      memset(tdo, 0, nr_bytes);
+      ret = -1;
+    }
+    if (io && io->tdo_ready)
+      io->tdo_ready(io, nr_bytes);
+    goto out;
+  }
+
+  // Note
+  ret = gpio_write(0, 1, 1) ? -1 : 0;
+
+  if (!ret && jtag_shift(len, tms, tdi, tdo, io))
+    ret = -1;
+
+  if (gpio_write(0, 1, 0))
+    ret = -1;
+
+  if (gang_targets > 1 && gang_check() < 0)
+    ret = -1;
+out:
+  if (trace_enabled) {
+    trace_shift(TRACE_KIND_SHIFT, len, tms, tdi, tdo, t0, trace_now());
+    trace_poll();
+  }
+  return ret;
+}
+
 /*
    This work, "xvcpi.c", is a derivative of "xvcServer.c" (https://github.com/Xilinx/XilinxVirtualCable)
    by Avnet and is used by Xilinx for XAPP1251.
@@ -0,0 +1,132 @@
+/*
+   Interface between the USB side (xvcpico.c) and the other parts of the
+   daemon that drive the Pico directly: the XVC server (xvcd.c), the SVF
+   player, the library API (libxvcpico.c) and so on.
+*/
+
+#ifndef XVCPICO_H
+#define XVCPICO_H
+
+#include <stdint.h>
+
+#define GANG_MAX 4
+
+// Open the Pico, returns the endpoint size or -1
+int device_init(void);
+void device_close(void);
+
+// Walk every TAP to Run-Test/Idle and find out what the firmware supports
+void tap_reset_probe(void);
+
+// Drive the pins directly (CMD_WRITE)
+int gpio_write(int tck, int tms, int tdi);
+
+// Gang mode with `targets` (2..GANG_MAX) targets, see README
+int gpio_gang(int targets);
+
+// AXM memory access over the second vendor interface, 0 on success
+int axm_access(_Bool write, uint32_t address, uint8_t *data, uint32_t size);
+
+// Measure the Pico alone: "shift", "loop" or "echo", 0 on success
+int selftest(const char *mode);
+
+// Hooks that let jtag_shift() overlap USB traffic with the producer of the
+// TDI vector and the consumer of the TDO vector. Both may be NULL.
+struct shift_io {
+  // Called before TDI bytes [0, upto) are used
+  void (*need_tdi)(struct shift_io *io, uint32_t upto);
+  // Called once TDO bytes [0, upto) are final
+  void (*tdo_ready)(struct shift_io *io, uint32_t upto);
+};
+
+// Clock `len` bits of TMS/TDI through the Pico and collect TDO. Returns -1
+// if a USB transfer failed, TDO is incomplete then.
+int jtag_shift(uint32_t len, const uint8_t *tms, const uint8_t *tdi, uint8_t *tdo, struct shift_io *io);
+
+// jtag_shift() wrapped in the pin setup/teardown done for every XVC "shift:"
+int xvc_shift(uint32_t len, const uint8_t *tms, const uint8_t *tdi, uint8_t *tdo, struct shift_io *io);
+
+// Clock `len` bits and let the Pico compare TDO against `exp` where `mask`
+// is set. Only the outcome crosses USB: returns 1 and the first failing bit
+// in `first` on a mismatch, 0 if everything matched, -1 on USB errors.
+int jtag_verify(uint32_t len, const uint8_t *tms, const uint8_t *tdi, const uint8_t *exp, const uint8_t *mask,
+                uint32_t *first);
+
+// jtag_verify() with the same setup/teardown as xvc_shift()
+int xvc_verify(uint32_t len, const uint8_t *tms, const uint8_t *tdi, const uint8_t *exp, const uint8_t *mask,
+               uint32_t *first);
+
+// SVF/XSVF player (svf.c), returns 0 on success
+int svf_play(const char *path);
+
+// Receives what svf_compile() would otherwise play. exp/mask are NULL for
+// batches without TDO checks. Return non-zero to abort.
+struct svf_sink {
+  int (*shift)(struct svf_sink *sink, uint32_t bits, const uint8_t *tms, const uint8_t *tdi, const uint8_t *exp,
+               const uint8_t *mask);
+  int (*delay)(struct svf_sink *sink, uint64_t us);
+};
+
+// Parse an SVF/XSVF file into a sink instead of playing it
+int svf_compile(const char *path, struct svf_sink *sink);
+
+// Image store on the Pico (firmware/store.h), implemented in xvcpico.c
+#define STORE_AUTORUN 0x01  // play the image at power-up
+struct pico_store_info {
+  int valid;
+  int flags;
+  int replaying;  // JTAG commands are held back until it is done
+  uint32_t size;
+  uint64_t hash;
+  uint32_t capacity;
+};
+int pico_store_info(struct pico_store_info *info);
+// Wait for an autorun replay to finish, so it is not mistaken for a
+// firmware that does not answer
+void pico_replay_wait(void);
+int pico_store(const uint8_t *image, uint32_t size, uint64_t hash, int flags);
+// Play the stored image. Returns 0 if it played, 1 on a TDO mismatch at
+// `bit`, 2 if the image has an operation the firmware does not know after
+// `bit`, -1 on errors.
+int pico_replay(uint32_t *bit);
+
+// SPI configuration flash on the Pico's SPI pins (firmware/spiflash.h),
+// implemented in xvcpico.c. Writes are queued, reads and waits send them.
+int pico_spi(int on);
+int pico_spi_write(const uint8_t *data, uint32_t len, int keep_cs);
+int pico_spi_read(uint8_t *data, uint32_t len, int keep_cs);
+// Queue a wait for the flash to finish erasing or programming. Up to `lag`
+// waits may stay unanswered, so the next commands are already on their way.
+// pico_spi_sync() sends everything and collects all answers. Both return 1
+// if the flash timed out, -1 on USB errors.
+int pico_spi_wait(int lag);
+int pico_spi_sync(void);
+
+// Stream from the FPGA over the PMOD pins (firmware/stream.h), implemented
+// in xvcpico.c. PCK runs at up to `khz`. `sink` gets the data in order as it
+// arrives, until it returns non-zero or *stop is set. AXM accesses fail
+// meanwhile. Returns -1 on errors, `status` has the firmware's counters.
+struct pico_stream_status {
+  int running;
+  uint32_t khz;
+  uint32_t bytes;
+  uint32_t stalls;  // times the host fell behind and PCK stopped
+};
+int pico_stream(unsigned khz, int (*sink)(const uint8_t *data, int len, void *user), void *user,
+                volatile int *stop, struct pico_stream_status *status);
+
+// Stream to a file, stdout ("-") or one TCP client (":port"), stream.c.
+// stream_open() is called before the Pico is opened, so nothing the daemon
+// prints ends up in the data.
+int stream_open(const char *dest);
+int stream_run(const char *dest, unsigned khz);
+
+// Erase, program and verify the configuration flash (spiflash.c)
+struct chain_device;
+int spiflash_program(const char *path, int verify_only, const struct chain_device *chain, int count);
+
+// Compile, upload (store.c) and replay flash images
+int store_file(const char *path, int flags);
+int store_replay(void);
+
+#endif
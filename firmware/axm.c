@@ -5,6 +5,7 @@
 #include "tusb.h"
 #include "xvcPico.h"
 #include "axm.h"
+#include "stream.h"
 
 extern buffer_info buffer_info_axm;
 
@@ -59,56 +60,81 @@ void __time_critical_func(pwrite)(uint8_t *buffer, int size, bool w) {
   }
 }
 
-void __time_critical_func(pmod_task)() {
-  static int write;
-  static int size;
+// State of the transaction in progress, see pmod_task()
+static int write;
+static int size;
+static int pending;  // bytes of the read chunk still to be queued
+
+void pmod_abort(void) {
+  size = 0;
+  pending = 0;
+  buffer_info_axm.busy = false;
+}
+
+// One step of an AXM transaction: one 64 byte packet goes to or comes from
+// the PMOD bus. A read whose answer doesn't fit into the vendor FIFO yet is
+// kept and retried on the next call instead of waiting here, so JTAG is not
+// held up by a slow host.
+bool __time_critical_func(pmod_task)() {
   int len;
   int max_wlen;
   int max_rlen = 64;
   uint8_t *buffer;
-  if (buffer_info_axm.busy) {
-    if (size == 0) {
-      write = buffer_info_axm.buffer[0];
-      len = buffer_info_axm.buffer[2] * 256 + buffer_info_axm.buffer[1];
-      switch (len) {
-        case 1: size = 1; break;
-        case 2: size = 2; break;
-        case 4: size = 4; break;
-        case 6:
-        case 7: size = 8; break;
-        default: size = len + 8; break;
-      }
-      plen(len, write);                              // LEN
-      pwrite(&buffer_info_axm.buffer[4], 4, write);  // ADDRESS
-      buffer = &buffer_info_axm.buffer[8];
-      max_wlen = 56;
+  if (!buffer_info_axm.busy)
+    return false;
+  if (stream_active()) {
+    // The pins belong to the stream (stream.h), drop the packet
+    buffer_info_axm.busy = false;
+    return true;
+  }
+  if (pending) {
+    pending -= tud_vendor_write(&buffer_info_axm.buffer[buffer_info_axm.count - pending], pending);
+    if (pending == 0 && size == 0)
+      buffer_info_axm.busy = false;
+    return true;
+  }
+  if (size == 0) {
+    write = buffer_info_axm.buffer[0];
+    len = buffer_info_axm.buffer[2] * 256 + buffer_info_axm.buffer[1];
+    switch (len) {
+      case 1: size = 1; break;
+      case 2: size = 2; break;
+      case 4: size = 4; break;
+      case 6:
+      case 7: size = 8; break;
+      default: size = len + 8; break;
+    }
+    plen(len, write);                              // LEN
+    pwrite(&buffer_info_axm.buffer[4], 4, write);  // ADDRESS
+    buffer = &buffer_info_axm.buffer[8];
+    max_wlen = 56;
+  } else {
+    buffer = &buffer_info_axm.buffer[0];
+    max_wlen = 64;
+  }
+  if (write) {              // WRITE
+    if (size > max_wlen) {  // DATA
+      pwrite(buffer, max_wlen, 1);
+      size -= max_wlen;
     } else {
-      buffer = &buffer_info_axm.buffer[0];
-      max_wlen = 64;
+      pwrite(buffer, size, 1);
+      size = 0;
     }
-    if (write) {              // WRITE
-      if (size > max_wlen) {  // DATA
-        pwrite(buffer, max_wlen, 1);
-        size -= max_wlen;
-      } else {
-        pwrite(buffer, size, 1);
-        size = 0;
-      }
-      buffer_info_axm.busy = false;
-    } else {  // READ
-      while (size) {
-        if (size > max_rlen) {  // DATA
-          pread(&buffer_info_axm.buffer[0], max_rlen);
-          buffer_info_axm.count = max_rlen;
-          size -= max_rlen;
-        } else {
-          pread(&buffer_info_axm.buffer[0], size);
-          buffer_info_axm.count = size;
-          buffer_info_axm.busy = false;
-          size = 0;
-        }
-        while (tud_vendor_write(buffer_info_axm.buffer, buffer_info_axm.count) == 0) tud_task();
-      }
+    buffer_info_axm.busy = false;
+  } else {  // READ
+    if (size > max_rlen) {  // DATA
+      pread(&buffer_info_axm.buffer[0], max_rlen);
+      buffer_info_axm.count = max_rlen;
+      size -= max_rlen;
+    } else {
+      pread(&buffer_info_axm.buffer[0], size);
+      buffer_info_axm.count = size;
+      size = 0;
     }
+    // The buffer stays busy until the chunk is queued
+    pending = buffer_info_axm.count - tud_vendor_write(buffer_info_axm.buffer, buffer_info_axm.count);
+    if (pending == 0 && size == 0)
+      buffer_info_axm.busy = false;
   }
+  return true;
 }
@@ -1,13 +1,7 @@
-#define PWD0_PIN 2
-#define PWD1_PIN 3
-#define PRD0_PIN 4
-#define PRD1_PIN 5
+#include "board_profile.h"  // PWD0_PIN .. PWAIT_PIN
 
-#define PCK_PIN 10
-#define PWRITE_PIN 11
-#define PWAIT_PIN 12
-
-#define AXM_ITF 0
+#define AXM_ITF 0      // vendor class instance, for tud_vendor_n_*()
+#define AXM_USB_ITF 2  // bInterfaceNumber, see usb_descriptors.c
 
 // typedef uint8_t cmd_buffer[64];
 // // [0]     W/R#
@@ -15,4 +9,10 @@
 // // [7:4]   ADDRESS
 // // [63:8]  DATA or [63:0]
 
-void pmod_task();
+bool pmod_task();
+
+// Drop a half done transaction, the stream takes over the pins (stream.h)
+void pmod_abort(void);
+
+// Clock out the 10 bit LEN field of a transaction header
+void plen(int c, bool w);
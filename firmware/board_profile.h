@@ -0,0 +1,21 @@
+/*
+  Pins and timing of the board the firmware is built for. The profile is
+  picked per UF2 with the XVC_BOARDS CMake option, see profiles/*.h. Since
+  everything here is a compile time constant, the GPIO masks in the shift
+  loops fold away.
+*/
+
+#ifndef BOARD_PROFILE_H
+#define BOARD_PROFILE_H
+
+#ifndef XVC_BOARD_PROFILE
+#define XVC_BOARD_PROFILE "profiles/pico.h"
+#endif
+#include XVC_BOARD_PROFILE
+
+// axm.c moves the two data bits of each direction with one shift
+_Static_assert(PWD1_PIN == PWD0_PIN + 1, "PWD1_PIN must follow PWD0_PIN");
+_Static_assert(PRD1_PIN == PRD0_PIN + 1, "PRD1_PIN must follow PRD0_PIN");
+_Static_assert(PRD1_PIN <= 7, "pread() shifts PRD1_PIN up to bit 7");
+
+#endif
@@ -32,14 +32,34 @@
 
 #include "tusb.h"
 #include "jtag.h"
+#include "jtag_usb.h"
+#include "spiflash.h"
+#include "store.h"
 
 // Modified
 enum CommandIdentifier {
   CMD_STOP = 0x00,
   CMD_XFER = 0x03,
   CMD_WRITE = 0x04,
+  CMD_GANG = 0x05,
+  CMD_GANG_STATUS = 0x06,
+  CMD_VERIFY = 0x07,
+  CMD_SHIFT_SMALL = 0x08,
+  CMD_PAD = 0x09,
+  CMD_STORE_BEGIN = 0x0A,
+  CMD_STORE_DATA = 0x0B,
+  CMD_STORE_END = 0x0C,
+  CMD_REPLAY = 0x0D,
+  CMD_SPI = 0x0E,
 };
 
+// Set in the command byte of CMD_XFER/CMD_PAD when another segment of the
+// same shift follows: TDO is not flushed at its end
+#define CMD_MORE 0x10
+
+// Largest CMD_SHIFT_SMALL, its TMS/TDI pairs fill one packet
+#define SMALL_SHIFT_BITS 248
+
 static inline void gpio_write(int tck, int tms, int tdi) {
   //gpio_put(tck_gpio, tck);
   //gpio_put(tms_gpio, tms);
@@ -56,6 +76,75 @@ static inline int gpio_read(void) {
   return gpio_get(tdo_gpio);
 }
 
+static uint32_t gang_mask;             // targets compared against target 0
+static uint32_t gang_mismatch;         // targets whose TDO differed
+static uint32_t gang_first[GANG_MAX];  // bit of their first mismatch
+static uint32_t gang_bits;             // bits shifted since the last status
+
+static uint8_t __time_critical_func(gang_shift)(uint8_t tms, uint8_t tdi, uint32_t bits) {
+  uint8_t tdo = 0;
+
+  for (uint32_t i = 0; i < bits; i++) {
+    gpio_write(0, tms & 1, tdi & 1);
+    tms >>= 1;
+    tdi >>= 1;
+    uint32_t pins = gpio_get_all();
+    uint32_t ref = (pins >> tdo_gpio) & 1;
+    tdo |= ref << i;
+    for (int t = 1; t < GANG_MAX; t++) {
+      uint32_t bit = 1ul << t;
+      if ((gang_mask & bit) && !(gang_mismatch & bit) && ((pins >> gang_tdo_gpio[t]) & 1) != ref) {
+        gang_mismatch |= bit;
+        gang_first[t] = gang_bits;
+      }
+    }
+    gang_bits++;
+    gpio_xor_mask(1ul << tck_gpio);
+  }
+  return tdo;
+}
+
+// Shift kernels. The pins are constants from the board profile, so the
+// masks fold into immediates and the full byte kernel unrolls completely.
+// Everything that shifts goes through shift_bits().
+static inline uint8_t __time_critical_func(shift_byte)(uint8_t tms, uint8_t tdi) {
+  uint8_t tdo = 0;
+
+#pragma GCC unroll 8
+  for (uint32_t i = 0; i < 8; i++) {
+    gpio_write(0, tms & 1, tdi & 1);
+    tms >>= 1;
+    tdi >>= 1;
+    tdo |= gpio_read() << i;
+    gpio_xor_mask(1ul << tck_gpio);
+  }
+  return tdo;
+}
+
+// The last 1..7 bits of a shift
+static uint8_t __time_critical_func(shift_partial)(uint8_t tms, uint8_t tdi, uint32_t bits) {
+  uint8_t tdo = 0;
+
+  for (uint32_t i = 0; i < bits; i++) {
+    gpio_write(0, tms & 1, tdi & 1);
+    tms >>= 1;
+    tdi >>= 1;
+    tdo |= gpio_read() << i;
+    gpio_xor_mask(1ul << tck_gpio);
+  }
+  return tdo;
+}
+
+static inline uint8_t __time_critical_func(shift_bits)(uint8_t tms, uint8_t tdi, uint32_t bits) {
+  if (gang_mask)
+    return gang_shift(tms, tdi, bits);
+  if (bits == 8)
+    return shift_byte(tms, tdi);
+  return shift_partial(tms, tdi, bits);
+}
+
+static bool xfer_more;  // the running CMD_XFER is not the last segment
+
 // Handler for "gpio_xfer" on the host side
 static int __time_critical_func(cmd_xfer)(int bitsLeft, const uint8_t *commands, uint8_t *tx_buffer) {
   int header_offset = 0;
@@ -64,6 +153,7 @@ static int __time_critical_func(cmd_xfer)(int bitsLeft, const uint8_t *commands,
 
   if (bitsLeft == 0) {
     com_offset = 5;
+    xfer_more = commands[0] & CMD_MORE;
     bitsLeft = (commands[4] << 24) | (commands[3] << 16) | (commands[2] << 8) | (commands[1] << 0);
     if (bitsLeft >= 28 * 8) {
       n = 28 * 8;
@@ -81,32 +171,15 @@ static int __time_critical_func(cmd_xfer)(int bitsLeft, const uint8_t *commands,
   int bytes = (n + 7) / 8;  // 16 or 32
 
   for (uint32_t j = 0; j < bytes; j++) {
-    uint8_t tdo = 0;
     uint8_t tms = commands[j * 2 + com_offset];
     uint8_t tdi = commands[j * 2 + com_offset + 1];
-    if (((j + 1) != bytes) | (n % 8) == 0) {
-      for (uint32_t i = 0; i < 8; i++) {
-        gpio_write(0, tms & 1, tdi & 1);
-        tms >>= 1;
-        tdi >>= 1;
-        tdo |= gpio_read() << i;
-        gpio_xor_mask(1ul << tck_gpio);
-      }
-    } else {
-      for (uint32_t i = 0; i < (n % 8); i++) {
-        gpio_write(0, tms & 1, tdi & 1);
-        tms >>= 1;
-        tdi >>= 1;
-        tdo |= gpio_read() << i;
-        gpio_xor_mask(1ul << tck_gpio);
-      }
-    }
-    tx_buffer[header_offset++] = tdo;
+    tx_buffer[header_offset++] = shift_bits(tms, tdi, (((j + 1) != bytes) | (n % 8) == 0) ? 8 : n % 8);
   }
 
-  /* Send the transfer response back to host */
-  tud_vendor_n_write(JTAG_ITF, tx_buffer, bytes);
-  tud_vendor_n_flush(JTAG_ITF);
+  /* Queue the transfer response, the host reads it in full packets */
+  jtag_usb_write(tx_buffer, bytes);
+  if (bitsLeft == n && !xfer_more)  // end of shift
+    jtag_usb_flush();
 
   // debug code
   // led_on();
@@ -114,6 +187,332 @@ static int __time_critical_func(cmd_xfer)(int bitsLeft, const uint8_t *commands,
   return bitsLeft - n;
 }
 
+static uint32_t verify_bits;   // bits compared so far
+static uint32_t verify_first;  // first mismatching bit
+static bool verify_fail;
+
+// Handler for "gpio_verify" on the host side. Like cmd_xfer(), but every
+// byte comes as a TMS/TDI/expected TDO/mask quadruple. TDO is compared here
+// and only a status goes back at the end of the shift: the fail flag
+// followed by the (little endian, 32bit) first mismatching bit.
+static int __time_critical_func(cmd_verify)(int bitsLeft, const uint8_t *commands, uint8_t *tx_buffer) {
+  uint32_t n;
+  int com_offset = 0;
+
+  if (bitsLeft == 0) {
+    com_offset = 5;
+    bitsLeft = (commands[4] << 24) | (commands[3] << 16) | (commands[2] << 8) | (commands[1] << 0);
+    n = bitsLeft >= 14 * 8 ? 14 * 8 : bitsLeft;
+    verify_bits = 0;
+    verify_fail = false;
+  } else {
+    n = bitsLeft >= 16 * 8 ? 16 * 8 : bitsLeft;
+  }
+
+  int bytes = (n + 7) / 8;
+
+  for (int j = 0; j < bytes; j++) {
+    const uint8_t *q = &commands[j * 4 + com_offset];
+    uint32_t bits = ((j + 1) != bytes || (n % 8) == 0) ? 8 : n % 8;
+    uint8_t diff = (shift_bits(q[0], q[1], bits) ^ q[2]) & q[3] & (0xFF >> (8 - bits));
+    if (diff && !verify_fail) {
+      verify_fail = true;
+      verify_first = verify_bits + __builtin_ctz(diff);
+    }
+    verify_bits += bits;
+  }
+
+  if (bitsLeft == n) {  // end of shift
+    uint32_t first = verify_fail ? verify_first : 0;
+    tx_buffer[0] = verify_fail;
+    tx_buffer[1] = (first >> 0) & 0xFF;
+    tx_buffer[2] = (first >> 8) & 0xFF;
+    tx_buffer[3] = (first >> 16) & 0xFF;
+    tx_buffer[4] = (first >> 24) & 0xFF;
+    jtag_usb_write(tx_buffer, 5);
+    jtag_usb_flush();
+  }
+
+  return bitsLeft - n;
+}
+
+// Handler for "gpio_shift_small" on the host side: [cmd][bits][TMS/TDI
+// pairs]. Does the pin setup/teardown the host would otherwise send as two
+// CMD_WRITEs itself and answers with TDO right away. Returns the number of
+// bytes used after the command byte.
+static uint32_t __time_critical_func(cmd_shift_small)(const uint8_t *commands, uint8_t *tx_buffer) {
+  uint32_t n = commands[1] <= SMALL_SHIFT_BITS ? commands[1] : SMALL_SHIFT_BITS;
+  uint32_t bytes = (n + 7) / 8;
+
+  gpio_write(0, 1, 1);
+  for (uint32_t j = 0; j < bytes; j++)
+    tx_buffer[j] = shift_bits(commands[2 + j * 2], commands[3 + j * 2], ((j + 1) != bytes || (n % 8) == 0) ? 8 : n % 8);
+  gpio_write(0, 1, 0);
+
+  jtag_usb_write(tx_buffer, bytes);
+  jtag_usb_flush();
+  return 1 + bytes * 2;
+}
+
+// Handler for "gpio_pad" on the host side: [cmd][bits (32bit)][tms][tdi].
+// Clocks a run of identical TMS/TDI values the host did not have to send,
+// e.g. the all-ones IR of bypassed devices or long constant stretches of a
+// bitstream. TDO is returned as usual. Returns the number of bytes used
+// after the command byte.
+static uint32_t __time_critical_func(cmd_pad)(const uint8_t *commands, uint8_t *tx_buffer) {
+  uint32_t n = (commands[4] << 24) | (commands[3] << 16) | (commands[2] << 8) | (commands[1] << 0);
+  uint8_t tms = commands[5] ? 0xFF : 0x00;
+  uint8_t tdi = commands[6] ? 0xFF : 0x00;
+  uint32_t fill = 0;
+
+  while (n) {
+    uint32_t bits = n >= 8 ? 8 : n;
+    tx_buffer[fill++] = shift_bits(tms, tdi, bits);
+    n -= bits;
+    if (fill == JTAG_PACKET_SIZE || !n) {
+      jtag_usb_write(tx_buffer, fill);
+      fill = 0;
+    }
+  }
+  if (!(commands[0] & CMD_MORE))
+    jtag_usb_flush();
+  return 6;
+}
+
+static uint32_t get_u32(const uint8_t *p) {
+  return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+// Handlers for the image upload, see store.h: "store_begin" [cmd][size
+// (32bit)][flags], "store_data" [cmd][n][n bytes] and "store_end" [cmd][hash
+// (64bit)]. Begin and end answer with a status byte, 0 on success. Return
+// the number of bytes used after the command byte.
+static uint32_t cmd_store_begin(const uint8_t *commands, uint8_t *tx_buffer) {
+  tx_buffer[0] = !store_begin(get_u32(&commands[1]), commands[5]);
+  jtag_usb_write(tx_buffer, 1);
+  jtag_usb_flush();
+  return 5;
+}
+
+static uint32_t cmd_store_data(const uint8_t *commands) {
+  uint32_t n = commands[1] <= JTAG_PACKET_SIZE - 2 ? commands[1] : JTAG_PACKET_SIZE - 2;
+
+  store_data(&commands[2], n);
+  return 1 + n;
+}
+
+static uint32_t cmd_store_end(const uint8_t *commands, uint8_t *tx_buffer) {
+  uint64_t hash = get_u32(&commands[1]) | (uint64_t)get_u32(&commands[5]) << 32;
+
+  tx_buffer[0] = !store_end(hash);
+  jtag_usb_write(tx_buffer, 1);
+  jtag_usb_flush();
+  return 8;
+}
+
+// Image replay, see store.h. Runs from the main loop like the self-test,
+// a slice at a time. Started by CMD_REPLAY, which is answered once the image
+// is done: [status][bit (32bit)], status 0 if it played, 1 on a TDO mismatch
+// at `bit`, 2 if there is no image, 3 on an unknown operation after `bit`
+// (a corrupt image or one made for other firmware).
+static const uint8_t *replay_pos;
+static bool replay_answer;         // the host waits for the status
+static uint32_t replay_bits;       // bits played so far
+static uint32_t replay_wait_until;
+static bool replay_waiting;
+static uint8_t replay_status[5];
+
+static void replay_done(uint8_t status, uint32_t bit) {
+  gpio_write(0, 1, 0);
+  replay_pos = NULL;
+  if (!replay_answer)
+    return;
+  replay_status[0] = status;
+  replay_status[1] = (bit >> 0) & 0xFF;
+  replay_status[2] = (bit >> 8) & 0xFF;
+  replay_status[3] = (bit >> 16) & 0xFF;
+  replay_status[4] = (bit >> 24) & 0xFF;
+  jtag_usb_write(replay_status, sizeof(replay_status));
+  jtag_usb_flush();
+}
+
+bool jtag_replay_active(void) {
+  return replay_pos != NULL;
+}
+
+void jtag_replay_start(bool answer) {
+  uint32_t size, flags;
+
+  replay_answer = answer;
+  replay_pos = store_image(&size, &flags);
+  if (!replay_pos) {
+    replay_done(2, 0);
+    return;
+  }
+  replay_bits = 0;
+  replay_waiting = false;
+  gpio_write(0, 1, 1);
+}
+
+// Check `bits` of TDO against the expected value, false on a mismatch
+static bool replay_check(uint8_t tdo, uint8_t exp, uint8_t mask, uint32_t bits) {
+  uint8_t diff = (tdo ^ exp) & mask & (0xFF >> (8 - bits));
+
+  if (diff) {
+    replay_done(1, replay_bits + __builtin_ctz(diff));
+    return false;
+  }
+  return true;
+}
+
+bool __time_critical_func(jtag_replay_step)(void) {
+  uint32_t start = time_us_32();
+  const uint8_t *p = replay_pos;
+
+  if (!p)
+    return false;
+  if (replay_waiting) {
+    if ((int32_t)(time_us_32() - replay_wait_until) < 0)
+      return true;
+    replay_waiting = false;
+  }
+
+  // About a millisecond of work. The time is only checked between ops and
+  // each op runs to completion, the image keeps them short (store.h).
+  while (time_us_32() - start < 1000) {
+    uint32_t n;
+
+    switch (p[0]) {
+      case IMG_END:
+        replay_done(0, 0);
+        return true;
+
+      case IMG_PAIRS:
+        n = p[1] | p[2] << 8;
+        for (uint32_t i = 0; i < n; i++)
+          shift_bits(p[3 + i * 2], p[4 + i * 2], 8);
+        replay_bits += n * 8;
+        p += 3 + n * 2;
+        break;
+
+      case IMG_TDI:
+        n = p[1] | p[2] << 8;
+        for (uint32_t i = 0; i < n; i++)
+          shift_bits(0x00, p[3 + i], 8);
+        replay_bits += n * 8;
+        p += 3 + n;
+        break;
+
+      case IMG_PAD:
+        n = get_u32(&p[1]);
+        for (uint32_t i = 0; i < n; i++)
+          shift_bits(p[5] ? 0xFF : 0x00, p[6] ? 0xFF : 0x00, 8);
+        replay_bits += n * 8;
+        p += 7;
+        break;
+
+      case IMG_CHECK:
+        n = p[1] | p[2] << 8;
+        for (uint32_t i = 0; i < n; i++) {
+          const uint8_t *q = &p[3 + i * 4];
+          if (!replay_check(shift_bits(q[0], q[1], 8), q[2], q[3], 8))
+            return true;
+          replay_bits += 8;
+        }
+        p += 3 + n * 4;
+        break;
+
+      case IMG_BITS:
+        n = p[1] & 7;
+        if (!replay_check(shift_bits(p[2], p[3], n), p[4], p[5], n))
+          return true;
+        replay_bits += n;
+        p += 6;
+        break;
+
+      case IMG_DELAY:
+        replay_wait_until = time_us_32() + get_u32(&p[1]);
+        replay_waiting = true;
+        replay_pos = p + 5;
+        return true;
+
+      default:
+        replay_done(3, replay_bits);
+        return true;
+    }
+  }
+  replay_pos = p;
+  return true;
+}
+
+// Bits shifted per jtag_selftest_step(), about a millisecond
+#define SELFTEST_SLICE 8192
+
+// Shifts a pseudo random pattern with TMS high, so a connected target just
+// stays in Test-Logic-Reset. Only the time spent shifting is counted, USB
+// work between the slices is not.
+bool __time_critical_func(jtag_selftest_step)(void) {
+  static uint32_t x;  // xorshift32 state
+  uint32_t left, start;
+
+  if (jtag_selftest.state != JTAG_SELFTEST_RUNNING)
+    return false;
+  if (jtag_selftest.bits == 0)
+    x = 0x2545F491;
+  left = jtag_selftest_len - jtag_selftest.bits;
+  if (left > SELFTEST_SLICE)
+    left = SELFTEST_SLICE;
+
+  start = time_us_32();
+  gpio_write(0, 1, 1);
+  for (uint32_t i = 0; i < left; i += 32) {
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    for (int b = 0; b < 32 && i + b < left; b += 8) {
+      uint32_t bits = left - i - b < 8 ? left - i - b : 8;
+      uint8_t tdi = x >> b;
+      uint8_t tdo = shift_bits(0xFF, tdi, bits);
+      jtag_selftest.errors += __builtin_popcount((tdo ^ tdi) & (0xFF >> (8 - bits)));
+    }
+  }
+  gpio_write(0, 1, 0);
+  jtag_selftest.us += time_us_32() - start;
+
+  jtag_selftest.bits += left;
+  if (jtag_selftest.bits == jtag_selftest_len)
+    jtag_selftest.state = JTAG_SELFTEST_DONE;
+  return true;
+}
+
+// Handler for "spi" on the host side, see spiflash.h. Returns the number of
+// bytes used after the command byte.
+static uint32_t cmd_spi(const uint8_t *commands, uint8_t *tx_buffer) {
+  uint32_t n;
+
+  switch (commands[1]) {
+    case SPI_ON:
+      spiflash_enable(true);
+      return 1;
+    case SPI_OFF:
+      spiflash_enable(false);
+      return 1;
+    case SPI_WRITE:
+      n = commands[3] <= JTAG_PACKET_SIZE - 4 ? commands[3] : JTAG_PACKET_SIZE - 4;
+      spiflash_write(&commands[4], n, commands[2] & SPI_KEEP_CS);
+      return 3 + n;
+    case SPI_READ:
+      spiflash_read(commands[3] | commands[4] << 8, commands[2] & SPI_KEEP_CS);
+      return 4;
+    case SPI_WAIT:
+      tx_buffer[0] = spiflash_wait();
+      jtag_usb_write(tx_buffer, 1);
+      jtag_usb_flush();
+      return 1;
+  }
+  return JTAG_PACKET_SIZE;  // unknown, drop the rest of the packet
+}
+
 // Handler for "gpio_write" on the host side
 static void cmd_write(const uint8_t *commands) {
   uint8_t tck, tms, tdi;
@@ -124,27 +523,111 @@ static void cmd_write(const uint8_t *commands) {
   gpio_write(tck & 1, tms & 1, tdi & 1);
 }
 
-void __time_critical_func(cmd_handle)(uint8_t *rx_buf, __attribute__((unused)) uint32_t count, uint8_t *tx_buf) {
+// Handler for "gpio_gang" on the host side
+static void cmd_gang(const uint8_t *commands) {
+  gang_mask = commands[1] & ((1ul << GANG_MAX) - 1) & ~1ul;
+  gang_mismatch = 0;
+  gang_bits = 0;
+}
+
+// Handler for "gpio_gang_status" on the host side: mismatch mask followed by
+// the (little endian, 32bit) first mismatching bit of every target. Reading
+// the status clears it.
+static void cmd_gang_status(uint8_t *tx_buffer) {
+  int offset = 0;
+
+  tx_buffer[offset++] = gang_mismatch;
+  for (int t = 0; t < GANG_MAX; t++) {
+    uint32_t first = (gang_mismatch & (1ul << t)) ? gang_first[t] : 0;
+    tx_buffer[offset++] = (first >> 0) & 0xFF;
+    tx_buffer[offset++] = (first >> 8) & 0xFF;
+    tx_buffer[offset++] = (first >> 16) & 0xFF;
+    tx_buffer[offset++] = (first >> 24) & 0xFF;
+  }
+  jtag_usb_write(tx_buffer, offset);
+  jtag_usb_flush();
+  gang_mismatch = 0;
+  gang_bits = 0;
+}
+
+void __time_critical_func(cmd_handle)(uint8_t *rx_buf, uint32_t count, uint8_t *tx_buf) {
   uint8_t *commands = (uint8_t *)rx_buf;
   static int bitsLeft;
+  static uint8_t xferCmd;  // CMD_XFER or CMD_VERIFY, while bitsLeft != 0
+
+  // USB throughput test, see JTAG_REQ_ECHO
+  if (jtag_echo) {
+    jtag_usb_write(rx_buf, count);
+    jtag_usb_flush();
+    return;
+  }
 
   if (bitsLeft != 0) {
-    bitsLeft = cmd_xfer(bitsLeft, commands, tx_buf);
+    if (xferCmd == CMD_VERIFY)
+      bitsLeft = cmd_verify(bitsLeft, commands, tx_buf);
+    else
+      bitsLeft = cmd_xfer(bitsLeft, commands, tx_buf);
     return;
   }
 
-  while (*commands != CMD_STOP) {
+  // A full packet has no room left for CMD_STOP
+  while (commands < rx_buf + count && *commands != CMD_STOP) {
     switch ((*commands) & 0x0F) {
       case CMD_XFER:
+        xferCmd = CMD_XFER;
         bitsLeft = cmd_xfer(bitsLeft, commands, tx_buf);
         return;
         break;
 
+      case CMD_VERIFY:
+        xferCmd = CMD_VERIFY;
+        bitsLeft = cmd_verify(bitsLeft, commands, tx_buf);
+        return;
+        break;
+
       case CMD_WRITE:
         cmd_write(commands);
         commands += 3;
         break;
 
+      case CMD_GANG:
+        cmd_gang(commands);
+        commands += 1;
+        break;
+
+      case CMD_GANG_STATUS:
+        cmd_gang_status(tx_buf);
+        break;
+
+      case CMD_SHIFT_SMALL:
+        commands += cmd_shift_small(commands, tx_buf);
+        break;
+
+      case CMD_PAD:
+        commands += cmd_pad(commands, tx_buf);
+        break;
+
+      case CMD_STORE_BEGIN:
+        commands += cmd_store_begin(commands, tx_buf);
+        break;
+
+      case CMD_STORE_DATA:
+        commands += cmd_store_data(commands);
+        break;
+
+      case CMD_STORE_END:
+        commands += cmd_store_end(commands, tx_buf);
+        break;
+
+      case CMD_REPLAY:
+        // Ends the packet, the rest of it would run before the image
+        jtag_replay_start(true);
+        return;
+
+      case CMD_SPI:
+        commands += cmd_spi(commands, tx_buf);
+        break;
+
       default:
         return; /* Unsupported command, halt */
         break;
@@ -28,18 +28,50 @@
  */
 void cmd_handle(uint8_t* rxbuf, uint32_t count, uint8_t* tx_buf);
 
-static int tdi_gpio = 16;
-static int tdo_gpio = 17;
-static int tck_gpio = 18;
-static int tms_gpio = 19;
+/**
+ * @brief Shift the next slice of a self-test started by JTAG_REQ_SELFTEST
+ *
+ * @return false if no self-test is running
+ */
+bool jtag_selftest_step(void);
+
+/**
+ * @brief Start playing the stored image (store.h)
+ *
+ * @param answer Send the outcome to the host when done
+ */
+void jtag_replay_start(bool answer);
+
+/**
+ * @brief Whether the stored image is being played
+ *
+ * Host packets are left queued until it is done (fetch_command()), so they
+ * can't clock the TAP in between or erase the image being played.
+ */
+bool jtag_replay_active(void);
+
+/**
+ * @brief Play the next slice of the stored image
+ *
+ * @return false if no image is being played
+ */
+bool jtag_replay_step(void);
+
+#include "board_profile.h"
 
-#define JTAG_ITF     1
+#define tdi_gpio JTAG_TDI_PIN
+#define tdo_gpio JTAG_TDO_PIN
+#define tck_gpio JTAG_TCK_PIN
+#define tms_gpio JTAG_TMS_PIN
 
-#define LED_PIN      25
+// Gang mode: TCK/TMS/TDI are wired to all targets in parallel, every target
+// drives its own TDO pin. Target 0 is the normal TDO pin, the TDO of the
+// other targets is compared against it.
+#define GANG_MAX 4
+static const int gang_tdo_gpio[GANG_MAX] = GANG_TDO_PINS;
 
 // How does this 'feature' even work? Perhaps the 'slew rate' on Raspberry Pi
 // GPIO pins (not Pico?) is slow enough to require these delays? Or the "GPIO
 // engine" on Raspberry Pi is slow to register GPIO actions?
-#define jtag_delay   3
-// #define jtag_delay   5
-// #define jtag_delay   50
+// Set per board, JTAG_DELAY in profiles/*.h.
+#define jtag_delay   JTAG_DELAY
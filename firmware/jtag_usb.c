@@ -0,0 +1,220 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "tusb.h"
+#include "device/usbd_pvt.h"
+#include "jtag.h"
+#include "jtag_usb.h"
+#include "store.h"
+#include "mem_layout.h"
+
+typedef struct {
+  CFG_TUSB_MEM_ALIGN uint8_t buffer[JTAG_PACKET_SIZE];
+  uint32_t count;
+} jtag_slot;
+
+static jtag_slot JTAG_DATA rx_slots[JTAG_RX_SLOTS];
+static jtag_slot JTAG_DATA tx_slots[JTAG_TX_SLOTS];
+
+static uint8_t jtag_rhport;
+static uint8_t ep_out;
+static uint8_t ep_in;
+
+// Free running packet counters, the slot index is the counter modulo the
+// ring size. rx_in/tx_out are advanced from jtagd_xfer_cb() (tud_task()),
+// rx_out/tx_in by the command handler.
+static volatile uint32_t rx_in, rx_out;
+static volatile uint32_t tx_in, tx_out;
+static volatile bool rx_armed, tx_armed;
+static uint32_t tx_fill;  // bytes in tx_slots[tx_in]
+static bool tx_waiting;   // a command is waiting in tx_wait()
+
+static void rx_arm(void) {
+  if (ep_out && !rx_armed && rx_in - rx_out < JTAG_RX_SLOTS) {
+    rx_armed = usbd_edpt_xfer(jtag_rhport, ep_out, rx_slots[rx_in % JTAG_RX_SLOTS].buffer, JTAG_PACKET_SIZE);
+  }
+}
+
+static void tx_arm(void) {
+  if (ep_in && !tx_armed && tx_out != tx_in) {
+    jtag_slot *slot = &tx_slots[tx_out % JTAG_TX_SLOTS];
+    tx_armed = usbd_edpt_xfer(jtag_rhport, ep_in, slot->buffer, slot->count);
+  }
+}
+
+bool jtag_usb_read(uint8_t **buf, uint32_t *count) {
+  while (rx_out != rx_in) {
+    jtag_slot *slot = &rx_slots[rx_out % JTAG_RX_SLOTS];
+    if (slot->count) {
+      *buf = slot->buffer;
+      *count = slot->count;
+      return true;
+    }
+    // Drop zero length packets
+    rx_out++;
+    rx_arm();
+  }
+  return false;
+}
+
+void jtag_usb_read_done(void) {
+  rx_out++;
+  rx_arm();
+}
+
+static void tx_commit(void) {
+  tx_slots[tx_in % JTAG_TX_SLOTS].count = tx_fill;
+  tx_fill = 0;
+  tx_in++;
+  tx_arm();
+}
+
+// Wait for the host to drain the ring. TinyUSB runs from here, in the middle
+// of a command, so its callbacks must not change how the command goes on:
+// jtag_usb_control_xfer_cb() refuses such requests meanwhile, and after a bus
+// reset the rest of the answer is dropped. Returns false in that case.
+static bool tx_wait(void) {
+  tx_waiting = true;
+  while (ep_in && tx_in - tx_out == JTAG_TX_SLOTS)
+    tud_task();
+  tx_waiting = false;
+  return ep_in != 0;
+}
+
+void jtag_usb_write(const uint8_t *buf, uint32_t count) {
+  while (count) {
+    if (!tx_wait())
+      return;
+
+    uint32_t n = JTAG_PACKET_SIZE - tx_fill;
+    if (n > count)
+      n = count;
+    memcpy(&tx_slots[tx_in % JTAG_TX_SLOTS].buffer[tx_fill], buf, n);
+    tx_fill += n;
+    buf += n;
+    count -= n;
+    if (tx_fill == JTAG_PACKET_SIZE)
+      tx_commit();
+  }
+}
+
+void jtag_usb_flush(void) {
+  if (tx_fill && tx_wait())
+    tx_commit();
+}
+
+//--------------------------------------------------------------------+
+// Class driver
+//--------------------------------------------------------------------+
+
+static void jtagd_reset(uint8_t rhport) {
+  (void)rhport;
+  ep_out = ep_in = 0;
+  rx_in = rx_out = 0;
+  tx_in = tx_out = 0;
+  rx_armed = tx_armed = false;
+  tx_fill = 0;
+}
+
+static void jtagd_init(void) {
+  jtagd_reset(0);
+}
+
+static uint16_t jtagd_open(uint8_t rhport, tusb_desc_interface_t const *itf_desc, uint16_t max_len) {
+  TU_VERIFY(itf_desc->bInterfaceClass == TUSB_CLASS_VENDOR_SPECIFIC, 0);
+  TU_VERIFY(itf_desc->bInterfaceNumber == JTAG_USB_ITF, 0);
+
+  uint16_t const drv_len = sizeof(tusb_desc_interface_t) + itf_desc->bNumEndpoints * sizeof(tusb_desc_endpoint_t);
+  TU_VERIFY(max_len >= drv_len, 0);
+
+  jtagd_reset(rhport);
+  TU_ASSERT(usbd_open_edpt_pair(rhport, tu_desc_next(itf_desc), 2, TUSB_XFER_BULK, &ep_out, &ep_in), 0);
+  jtag_rhport = rhport;
+  rx_arm();
+
+  return drv_len;
+}
+
+struct jtag_selftest jtag_selftest;
+uint32_t jtag_selftest_len;
+volatile bool jtag_echo;
+
+// The self-test itself runs from the main loop (jtag_selftest_step()), so
+// USB keeps being served while it shifts
+bool jtag_usb_control_xfer_cb(uint8_t rhport, uint8_t stage, tusb_control_request_t const *request) {
+  if (stage != CONTROL_STAGE_SETUP)
+    return true;
+
+  switch (request->bRequest) {
+    case JTAG_REQ_SELFTEST:
+      if (tx_waiting)
+        return false;  // a command is still answering, see tx_wait()
+      memset(&jtag_selftest, 0, sizeof(jtag_selftest));
+      jtag_selftest_len = (request->wValue < 4000 ? request->wValue : 4000) * 1000000u;
+      jtag_selftest.state = JTAG_SELFTEST_RUNNING;
+      return tud_control_status(rhport, request);
+
+    case JTAG_REQ_SELFTEST_RESULT:
+      return tud_control_xfer(rhport, request, &jtag_selftest, sizeof(jtag_selftest));
+
+    case JTAG_REQ_ECHO:
+      if (tx_waiting)
+        return false;
+      jtag_echo = request->wValue != 0;
+      return tud_control_status(rhport, request);
+
+    case JTAG_REQ_STORE_INFO: {
+      static struct store_info info;
+      store_get_info(&info);
+      info.replaying = jtag_replay_active();
+      return tud_control_xfer(rhport, request, &info, sizeof(info));
+    }
+  }
+  return false;  // stall
+}
+
+// TinyUSB hands vendor requests to tud_vendor_control_xfer_cb() only, the
+// interface has no standard or class requests of its own
+static bool jtagd_control_xfer_cb(uint8_t rhport, uint8_t stage, tusb_control_request_t const *request) {
+  (void)rhport;
+  (void)stage;
+  (void)request;
+  return false;  // stall
+}
+
+static bool jtagd_xfer_cb(uint8_t rhport, uint8_t ep_addr, xfer_result_t result, uint32_t xferred_bytes) {
+  (void)rhport;
+  (void)result;
+
+  if (ep_addr == ep_out) {
+    rx_slots[rx_in % JTAG_RX_SLOTS].count = xferred_bytes;
+    rx_in++;
+    rx_armed = false;
+    rx_arm();
+  } else if (ep_addr == ep_in) {
+    tx_out++;
+    tx_armed = false;
+    tx_arm();
+  }
+  return true;
+}
+
+static usbd_class_driver_t const jtagd_driver = {
+#if CFG_TUSB_DEBUG >= 2
+  .name = "JTAG",
+#endif
+  .init = jtagd_init,
+  .reset = jtagd_reset,
+  .open = jtagd_open,
+  .control_xfer_cb = jtagd_control_xfer_cb,
+  .xfer_cb = jtagd_xfer_cb,
+  .sof = NULL,
+};
+
+// TinyUSB asks for application drivers before its built-in classes, so the
+// JTAG interface is ours and the vendor class only sees the AXM interface.
+usbd_class_driver_t const *usbd_app_driver_get_cb(uint8_t *driver_count) {
+  *driver_count = 1;
+  return &jtagd_driver;
+}
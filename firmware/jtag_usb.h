@@ -0,0 +1,79 @@
+/*
+  Direct endpoint access for the JTAG vendor interface.
+
+  The JTAG interface does not go through TinyUSB's vendor class and its
+  FIFOs. OUT packets are received straight into a ring of packet buffers and
+  TDO is queued into a second ring that is handed to the IN endpoint, so
+  several packets can be in flight in each direction without any extra copy
+  and without two OUT packets ever being merged into one command buffer.
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "tusb.h"
+
+#define JTAG_USB_ITF 3  // bInterfaceNumber, see usb_descriptors.c
+
+#define JTAG_PACKET_SIZE 64
+#define JTAG_RX_SLOTS 8
+#define JTAG_TX_SLOTS 8
+
+/**
+ * @brief Get the oldest received packet
+ *
+ * @param buf Set to the packet data
+ * @param count Set to the packet length
+ * @return false if no packet is pending
+ */
+bool jtag_usb_read(uint8_t **buf, uint32_t *count);
+
+/**
+ * @brief Release the packet returned by jtag_usb_read()
+ */
+void jtag_usb_read_done(void);
+
+/**
+ * @brief Queue data for the IN endpoint, full packets are sent right away
+ *
+ * While the ring is full this runs tud_task() until the host reads, so USB
+ * callbacks can fire in the middle of a command (see tx_wait()). Must not be
+ * called from within tud_task() itself.
+ */
+void jtag_usb_write(const uint8_t *buf, uint32_t count);
+
+/**
+ * @brief Send the partially filled IN packet, if any. May run tud_task()
+ * like jtag_usb_write().
+ */
+void jtag_usb_flush(void);
+
+// Vendor requests on the JTAG interface (recipient interface, wIndex =
+// JTAG_USB_ITF). They measure the parts of the data path separately.
+#define JTAG_REQ_SELFTEST 0x01         // wValue: Mbit to shift, starts a self-test
+#define JTAG_REQ_SELFTEST_RESULT 0x02  // IN, struct jtag_selftest
+#define JTAG_REQ_ECHO 0x03             // wValue: 1 to echo OUT packets back unchanged
+#define JTAG_REQ_STORE_INFO 0x04       // IN, struct store_info (store.h)
+
+enum {
+  JTAG_SELFTEST_IDLE = 0,
+  JTAG_SELFTEST_RUNNING = 1,
+  JTAG_SELFTEST_DONE = 2,
+};
+
+// Little endian, as it goes over USB
+struct jtag_selftest {
+  uint8_t state;
+  uint8_t reserved[3];
+  uint32_t bits;    // bits shifted so far
+  uint32_t us;      // time spent shifting them
+  uint32_t errors;  // bits where TDO != TDI, only meaningful with TDI wired to TDO
+};
+
+/**
+ * @brief Vendor requests on the JTAG interface, see tud_vendor_control_xfer_cb()
+ */
+bool jtag_usb_control_xfer_cb(uint8_t rhport, uint8_t stage, tusb_control_request_t const *request);
+
+extern struct jtag_selftest jtag_selftest;
+extern uint32_t jtag_selftest_len;  // bits the running self-test shifts
+extern volatile bool jtag_echo;
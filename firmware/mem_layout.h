@@ -0,0 +1,31 @@
+/*
+  Where code and buffers live in SRAM.
+
+  The RP2040 has four 64K banks striped word by word (SRAM0-3) and two 4K
+  banks of their own (SRAM4 = SCRATCH_X, SRAM5 = SCRATCH_Y). A bank serves
+  one bus master per cycle, so whatever two masters use at the same time
+  is kept apart:
+
+    SCRATCH_X  core 1: the UART bridge loop, its stack and the UART rings
+    SCRATCH_Y  core 0: its stack, the JTAG packet rings and the command
+               response buffer
+    striped    code, TinyUSB's FIFOs, the AXM buffer and the PMOD stream
+               ring that DMA writes into
+
+  The only traffic between the banks is core 0 reading and writing the
+  UART rings, a few bytes at a time. The SDK already puts both stacks in
+  the scratch banks, the linker fails if one of them runs out of room.
+
+  With XVC_COPY_TO_RAM (the default, see CMakeLists.txt) all code is
+  copied to the striped banks at boot, so shifting never waits for an XIP
+  cache miss and the flash is only used by store.c.
+*/
+
+#include "pico.h"
+
+// Functions and data of core 1, next to its stack
+#define CORE1_FUNC(name) __scratch_x(__STRING(name)) name
+#define CORE1_DATA __scratch_x("core1")
+
+// Core 0's JTAG buffers, next to its stack
+#define JTAG_DATA __scratch_y("jtag")
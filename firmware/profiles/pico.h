@@ -0,0 +1,38 @@
+// Raspberry Pi Pico, the pinout in README.md
+
+#define BOARD_NAME "pico"
+
+// JTAG
+#define JTAG_TDI_PIN 16
+#define JTAG_TDO_PIN 17
+#define JTAG_TCK_PIN 18
+#define JTAG_TMS_PIN 19
+#define JTAG_DELAY 3  // nops after every pin change
+
+// TDO of gang targets 0..3, target 0 is JTAG_TDO_PIN
+#define GANG_TDO_PINS { 17, 20, 21, 22 }
+
+// AXM bus on the PMOD header (see axm.h)
+#define PWD0_PIN 2
+#define PWD1_PIN 3
+#define PRD0_PIN 4
+#define PRD1_PIN 5
+#define PCK_PIN 10
+#define PWRITE_PIN 11
+#define PWAIT_PIN 12
+
+// SPI configuration flash of the target (see spiflash.h), wired to the flash
+// chip itself. Any SPI1 pins will do, CS is a plain GPIO.
+#define SPI_FLASH_SPI spi1
+#define SPI_FLASH_SCK_PIN 26
+#define SPI_FLASH_MOSI_PIN 27
+#define SPI_FLASH_MISO_PIN 28
+#define SPI_FLASH_CS_PIN 14
+#define SPI_FLASH_BAUD (20 * 1000 * 1000)
+
+// USB UART
+#define UART_ID uart0
+#define UART_TX_PIN 0
+#define UART_RX_PIN 1
+
+#define LED_PIN 25
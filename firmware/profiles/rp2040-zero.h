@@ -0,0 +1,40 @@
+// Waveshare RP2040-Zero and similar boards that only bring out GPIO0-15 and
+// GPIO26-29. JTAG moves to the four pins on the short edge.
+
+#define BOARD_NAME "rp2040-zero"
+
+// JTAG
+#define JTAG_TDI_PIN 26
+#define JTAG_TDO_PIN 27
+#define JTAG_TCK_PIN 28
+#define JTAG_TMS_PIN 29
+#define JTAG_DELAY 3  // nops after every pin change
+
+// TDO of gang targets 0..3, target 0 is JTAG_TDO_PIN
+#define GANG_TDO_PINS { 27, 13, 14, 15 }
+
+// AXM bus (see axm.h)
+#define PWD0_PIN 2
+#define PWD1_PIN 3
+#define PRD0_PIN 4
+#define PRD1_PIN 5
+#define PCK_PIN 10
+#define PWRITE_PIN 11
+#define PWAIT_PIN 12
+
+// SPI configuration flash of the target (see spiflash.h). SCK and MOSI are
+// the TDO pins of gang targets 2 and 3, so gang mode with more than two
+// targets and SPI mode exclude each other.
+#define SPI_FLASH_SPI spi1
+#define SPI_FLASH_SCK_PIN 14
+#define SPI_FLASH_MOSI_PIN 15
+#define SPI_FLASH_MISO_PIN 8
+#define SPI_FLASH_CS_PIN 9
+#define SPI_FLASH_BAUD (20 * 1000 * 1000)
+
+// USB UART
+#define UART_ID uart0
+#define UART_TX_PIN 0
+#define UART_RX_PIN 1
+
+// The on-board LED is a WS2812, so LED_PIN is left undefined
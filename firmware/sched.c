@@ -0,0 +1,42 @@
+#include "pico/stdlib.h"
+#include "sched.h"
+
+// One turn: step until the task runs out of work or of budget
+static bool __time_critical_func(sched_turn)(struct sched_task *task) {
+  uint32_t start = time_us_32();
+  bool busy = false;
+
+  while (task->step()) {
+    busy = true;
+    if (time_us_32() - start >= task->budget_us)
+      break;
+  }
+  return busy;
+}
+
+static void __time_critical_func(sched_urgent)(struct sched_task *tasks, int count) {
+  for (int i = 0; i < count; i++) {
+    if (tasks[i].urgent)
+      sched_turn(&tasks[i]);
+  }
+}
+
+void __time_critical_func(sched_run)(struct sched_task *tasks, int count) {
+  while (1) {
+    for (int i = 0; i < count; i++) {
+      struct sched_task *task = &tasks[i];
+      uint32_t start;
+
+      if (task->urgent) {
+        sched_turn(task);
+        continue;
+      }
+      start = time_us_32();
+      while (task->step()) {
+        sched_urgent(tasks, count);
+        if (time_us_32() - start >= task->budget_us)
+          break;
+      }
+    }
+  }
+}
@@ -0,0 +1,28 @@
+/*
+  Cooperative scheduler for the work done on core 0.
+
+  Each task is a step function that does a bounded piece of work and returns
+  whether it found anything to do. Tasks are listed highest priority first.
+  A task keeps the CPU for as long as it has work, up to its budget, then the
+  next one gets a turn. Urgent tasks (USB and JTAG) are also run between the
+  steps of the others. So a JTAG packet waits for at most one step of a
+  long AXM burst or of UART forwarding, never for the whole burst.
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct sched_task {
+  const char *name;
+  bool (*step)(void);  // do a bounded piece of work, false if there was none
+  uint32_t budget_us;  // longest turn, 0 for a single step
+  bool urgent;         // also runs between the steps of non-urgent tasks
+};
+
+/**
+ * @brief Run the tasks forever
+ *
+ * @param tasks Tasks, highest priority first
+ * @param count Number of tasks
+ */
+void sched_run(struct sched_task *tasks, int count);
@@ -0,0 +1,170 @@
+#include <string.h>
+#include "pico/stdlib.h"
+#include "hardware/dma.h"
+#include "hardware/spi.h"
+#include "board_profile.h"  // SPI_FLASH_*
+#include "jtag_usb.h"
+#include "spiflash.h"
+
+#define FLASH_RDSR 0x05
+#define FLASH_WIP 0x01
+
+// Longest SPI_WAIT, a 64K block erase takes up to about 2 s
+#define WAIT_TIMEOUT_US (5 * 1000 * 1000)
+
+#ifdef SPI_FLASH_SPI
+
+// Reads are moved by DMA a chunk at a time. While one chunk is copied to the
+// USB ring, the next one is already being clocked in.
+#define READ_CHUNK 512
+
+static const uint spi_pins[] = { SPI_FLASH_SCK_PIN, SPI_FLASH_MOSI_PIN, SPI_FLASH_MISO_PIN };
+
+static bool enabled;
+static int dma_tx = -1, dma_rx = -1;
+static uint8_t read_buf[2][READ_CHUNK];
+
+void spiflash_enable(bool on) {
+  if (on == enabled)
+    return;
+  if (on) {
+    spi_init(SPI_FLASH_SPI, SPI_FLASH_BAUD);
+    spi_set_format(SPI_FLASH_SPI, 8, SPI_CPOL_0, SPI_CPHA_0, SPI_MSB_FIRST);
+    gpio_init(SPI_FLASH_CS_PIN);
+    gpio_put(SPI_FLASH_CS_PIN, 1);
+    gpio_set_dir(SPI_FLASH_CS_PIN, GPIO_OUT);
+    for (unsigned i = 0; i < count_of(spi_pins); i++)
+      gpio_set_function(spi_pins[i], GPIO_FUNC_SPI);
+    // No flash answers with all ones instead of noise
+    gpio_pull_up(SPI_FLASH_MISO_PIN);
+    if (dma_tx < 0) {
+      dma_tx = dma_claim_unused_channel(true);
+      dma_rx = dma_claim_unused_channel(true);
+    }
+  } else {
+    spi_deinit(SPI_FLASH_SPI);
+    for (unsigned i = 0; i < count_of(spi_pins); i++) {
+      gpio_init(spi_pins[i]);
+      gpio_disable_pulls(spi_pins[i]);
+    }
+    gpio_init(SPI_FLASH_CS_PIN);
+    gpio_disable_pulls(SPI_FLASH_CS_PIN);
+  }
+  enabled = on;
+}
+
+static inline void cs(bool active) {
+  gpio_put(SPI_FLASH_CS_PIN, !active);
+}
+
+void spiflash_write(const uint8_t *data, uint32_t len, bool keep_cs) {
+  if (!enabled)
+    return;
+  cs(true);
+  spi_write_blocking(SPI_FLASH_SPI, data, len);
+  if (!keep_cs)
+    cs(false);
+}
+
+// Clock in `len` bytes: one channel feeds 0xFF to the TX FIFO, the other
+// drains the RX FIFO into `buf`
+static void read_start(uint8_t *buf, uint32_t len) {
+  static const uint8_t ones = 0xFF;
+  dma_channel_config c;
+
+  c = dma_channel_get_default_config(dma_tx);
+  channel_config_set_transfer_data_size(&c, DMA_SIZE_8);
+  channel_config_set_dreq(&c, spi_get_dreq(SPI_FLASH_SPI, true));
+  channel_config_set_read_increment(&c, false);
+  channel_config_set_write_increment(&c, false);
+  dma_channel_configure(dma_tx, &c, &spi_get_hw(SPI_FLASH_SPI)->dr, &ones, len, false);
+
+  c = dma_channel_get_default_config(dma_rx);
+  channel_config_set_transfer_data_size(&c, DMA_SIZE_8);
+  channel_config_set_dreq(&c, spi_get_dreq(SPI_FLASH_SPI, false));
+  channel_config_set_read_increment(&c, false);
+  channel_config_set_write_increment(&c, true);
+  dma_channel_configure(dma_rx, &c, buf, &spi_get_hw(SPI_FLASH_SPI)->dr, len, false);
+
+  dma_start_channel_mask((1u << dma_tx) | (1u << dma_rx));
+}
+
+void spiflash_read(uint32_t len, bool keep_cs) {
+  uint32_t n = len < READ_CHUNK ? len : READ_CHUNK;
+  int cur = 0;
+
+  if (!enabled) {
+    // The host still waits for `len` bytes
+    memset(read_buf[0], 0xFF, READ_CHUNK);
+    for (; len; len -= n, n = len < READ_CHUNK ? len : READ_CHUNK)
+      jtag_usb_write(read_buf[0], n);
+    jtag_usb_flush();
+    return;
+  }
+
+  cs(true);
+  if (n)
+    read_start(read_buf[cur], n);
+  while (len) {
+    uint32_t done = n;
+
+    dma_channel_wait_for_finish_blocking(dma_rx);
+    len -= done;
+    n = len < READ_CHUNK ? len : READ_CHUNK;
+    if (n)
+      read_start(read_buf[!cur], n);
+    jtag_usb_write(read_buf[cur], done);
+    cur = !cur;
+  }
+  jtag_usb_flush();
+  if (!keep_cs)
+    cs(false);
+}
+
+uint8_t spiflash_wait(void) {
+  const uint8_t cmd = FLASH_RDSR;
+  uint32_t start = time_us_32();
+  uint8_t status;
+
+  if (!enabled)
+    return 0xFF;
+  // The flash repeats the status register for as long as CS stays low
+  cs(true);
+  spi_write_blocking(SPI_FLASH_SPI, &cmd, 1);
+  do {
+    spi_read_blocking(SPI_FLASH_SPI, 0xFF, &status, 1);
+  } while ((status & FLASH_WIP) && time_us_32() - start < WAIT_TIMEOUT_US);
+  cs(false);
+  return status;
+}
+
+#else
+
+// The board has no pins for it, reads and waits answer with all ones
+void spiflash_enable(bool on) {
+  (void)on;
+}
+
+void spiflash_write(const uint8_t *data, uint32_t len, bool keep_cs) {
+  (void)data;
+  (void)len;
+  (void)keep_cs;
+}
+
+void spiflash_read(uint32_t len, bool keep_cs) {
+  static const uint8_t ones[64] = { [0 ... 63] = 0xFF };
+
+  (void)keep_cs;
+  while (len) {
+    uint32_t n = len < sizeof(ones) ? len : sizeof(ones);
+    jtag_usb_write(ones, n);
+    len -= n;
+  }
+  jtag_usb_flush();
+}
+
+uint8_t spiflash_wait(void) {
+  return 0xFF;
+}
+
+#endif
@@ -0,0 +1,40 @@
+/*
+  Direct access to the target's SPI configuration flash, on the pins of the
+  board profile (SPI_FLASH_*). The pins are left floating until the host
+  turns SPI mode on, so the FPGA can still read the flash itself.
+
+  The host drives the flash commands, the Pico only moves bytes:
+
+    "spi" [cmd][SPI_ON]
+          [cmd][SPI_OFF]
+          [cmd][SPI_WRITE][flags][n][n bytes]     n <= 60
+          [cmd][SPI_READ][flags][n (16bit)]       -> n bytes
+          [cmd][SPI_WAIT]                         -> status register
+
+  CS goes low for a write or read and high again after it, unless flags has
+  SPI_KEEP_CS: then the next write or read continues the same flash command.
+  SPI_WAIT polls the status register until the flash is no longer busy and
+  answers with its last value.
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+
+enum {
+  SPI_ON = 0x01,
+  SPI_OFF = 0x02,
+  SPI_WRITE = 0x03,
+  SPI_READ = 0x04,
+  SPI_WAIT = 0x05,
+};
+
+#define SPI_KEEP_CS 0x01
+
+void spiflash_enable(bool on);
+void spiflash_write(const uint8_t *data, uint32_t len, bool keep_cs);
+
+// Read `len` bytes and send them to the host
+void spiflash_read(uint32_t len, bool keep_cs);
+
+// Wait until the flash is done erasing or programming, returns its status
+uint8_t spiflash_wait(void);
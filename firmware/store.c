@@ -0,0 +1,158 @@
+#include <string.h>
+#include "pico/stdlib.h"
+#include "pico/multicore.h"
+#include "hardware/flash.h"
+#include "hardware/sync.h"
+#include "store.h"
+
+#define STORE_MAGIC 0x49435658  // "XVCI"
+
+struct store_header {
+  uint32_t magic;
+  uint32_t size;
+  uint64_t hash;
+  uint32_t flags;
+  uint32_t reserved;
+};
+
+extern char __flash_binary_end;
+
+// Flash offsets of the header sector and of the image
+static uint32_t header_offset(void) {
+  return ((uintptr_t)&__flash_binary_end - XIP_BASE + FLASH_SECTOR_SIZE - 1) & ~(FLASH_SECTOR_SIZE - 1);
+}
+
+static uint32_t image_offset(void) {
+  return header_offset() + FLASH_SECTOR_SIZE;
+}
+
+static uint32_t capacity(void) {
+  return PICO_FLASH_SIZE_BYTES - image_offset();
+}
+
+uint64_t store_hash(const uint8_t *data, uint32_t len) {
+  uint64_t h = 0xcbf29ce484222325ull;  // FNV-1a
+
+  for (uint32_t i = 0; i < len; i++) {
+    h ^= data[i];
+    h *= 0x100000001b3ull;
+  }
+  return h;
+}
+
+static const struct store_header *header(void) {
+  return (const struct store_header *)(XIP_BASE + header_offset());
+}
+
+// Core 1 keeps running the UART loop, it is parked while the flash is busy
+static void flash_erase(uint32_t offset) {
+  multicore_lockout_start_blocking();
+  uint32_t irq = save_and_disable_interrupts();
+  flash_range_erase(offset, FLASH_SECTOR_SIZE);
+  restore_interrupts(irq);
+  multicore_lockout_end_blocking();
+}
+
+static void flash_program(uint32_t offset, const uint8_t *data) {
+  multicore_lockout_start_blocking();
+  uint32_t irq = save_and_disable_interrupts();
+  flash_range_program(offset, data, FLASH_PAGE_SIZE);
+  restore_interrupts(irq);
+  multicore_lockout_end_blocking();
+}
+
+// Hashing a large image takes a while on the M0+, so the outcome is kept
+// until the next upload
+static enum { UNCHECKED, INVALID, VALID } image_state;
+
+const uint8_t *store_image(uint32_t *size, uint32_t *flags) {
+  const struct store_header *h = header();
+  const uint8_t *image = (const uint8_t *)(XIP_BASE + image_offset());
+
+  if (image_state == UNCHECKED) {
+    if (h->magic == STORE_MAGIC && h->size <= capacity() && store_hash(image, h->size) == h->hash)
+      image_state = VALID;
+    else
+      image_state = INVALID;
+  }
+  if (image_state != VALID)
+    return NULL;
+  *size = h->size;
+  *flags = h->flags;
+  return image;
+}
+
+void store_get_info(struct store_info *info) {
+  uint32_t size, flags;
+
+  memset(info, 0, sizeof(*info));
+  info->capacity = capacity();
+  if (store_image(&size, &flags)) {
+    info->valid = 1;
+    info->flags = flags;
+    info->size = size;
+    info->hash = header()->hash;
+  }
+}
+
+//--------------------------------------------------------------------+
+// Upload
+//--------------------------------------------------------------------+
+
+static uint8_t page[FLASH_PAGE_SIZE];
+static uint32_t store_size, store_flags, store_pos;
+
+static void page_write(void) {
+  uint32_t offset = image_offset() + ((store_pos - 1) & ~(FLASH_PAGE_SIZE - 1));
+
+  if (offset % FLASH_SECTOR_SIZE == 0)
+    flash_erase(offset);
+  flash_program(offset, page);
+  memset(page, 0xFF, sizeof(page));
+}
+
+bool store_begin(uint32_t size, uint32_t flags) {
+  if (size > capacity())
+    return false;
+  // Invalidate the old image first
+  image_state = INVALID;
+  flash_erase(header_offset());
+  store_size = size;
+  store_flags = flags;
+  store_pos = 0;
+  memset(page, 0xFF, sizeof(page));
+  return true;
+}
+
+void store_data(const uint8_t *data, uint32_t len) {
+  while (len && store_pos < store_size) {
+    page[store_pos % FLASH_PAGE_SIZE] = *data++;
+    len--;
+    store_pos++;
+    if (store_pos % FLASH_PAGE_SIZE == 0)
+      page_write();
+  }
+}
+
+bool store_end(uint64_t hash) {
+  const uint8_t *image = (const uint8_t *)(XIP_BASE + image_offset());
+  struct store_header *h = (struct store_header *)page;
+
+  if (store_pos != store_size)
+    return false;
+  if (store_pos % FLASH_PAGE_SIZE)
+    page_write();
+  if (store_hash(image, store_size) != hash)
+    return false;
+
+  memset(page, 0xFF, sizeof(page));
+  h->magic = STORE_MAGIC;
+  h->size = store_size;
+  h->hash = hash;
+  h->flags = store_flags;
+  h->reserved = 0;
+  flash_program(header_offset(), page);
+  memset(page, 0xFF, sizeof(page));
+  image_state = VALID;
+  return true;
+}
@@ -0,0 +1,68 @@
+/*
+  Image store in the flash after the firmware.
+
+  The first sector holds a header, the image follows in the next sectors.
+  The header is written last and carries the FNV-1a hash of the image,
+  so an interrupted upload or a larger firmware that grew into the region
+  leaves no valid image behind.
+
+  An image is a list of JTAG operations, played by jtag_replay_step():
+
+    IMG_END    [op]
+    IMG_PAIRS  [op][n u16] n TMS/TDI byte pairs
+    IMG_TDI    [op][n u16] n TDI bytes, TMS low
+    IMG_PAD    [op][n u32][tms][tdi] n constant bytes (0x00 or 0xFF each)
+    IMG_CHECK  [op][n u16] n TMS/TDI/expected TDO/mask byte quadruples
+    IMG_BITS   [op][bits][tms][tdi][exp][mask] 1-7 bits
+    IMG_DELAY  [op][us u32]
+
+  All numbers little endian, bits LSB first as in CMD_XFER. The replay only
+  yields between operations, so they should each take a few milliseconds
+  at most.
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+
+enum {
+  IMG_END = 0x00,
+  IMG_PAIRS = 0x01,
+  IMG_TDI = 0x02,
+  IMG_PAD = 0x03,
+  IMG_CHECK = 0x04,
+  IMG_BITS = 0x05,
+  IMG_DELAY = 0x06,
+};
+
+#define STORE_AUTORUN 0x01  // play the image at power-up
+
+// Little endian, as it goes over USB (JTAG_REQ_STORE_INFO)
+struct store_info {
+  uint8_t valid;
+  uint8_t flags;
+  uint8_t replaying;  // the image is being played, JTAG commands wait for it
+  uint8_t reserved;
+  uint32_t size;
+  uint64_t hash;
+  uint32_t capacity;  // largest image that fits
+  uint32_t reserved2;
+};
+
+void store_get_info(struct store_info *info);
+
+/**
+ * @brief The stored image, if there is a valid one
+ *
+ * @param size Set to the image size
+ * @param flags Set to the STORE_* flags it was stored with
+ * @return The image in XIP flash, NULL if there is none
+ */
+const uint8_t *store_image(uint32_t *size, uint32_t *flags);
+
+// Upload: store_begin(), store_data() for every chunk in order, store_end().
+// Sectors are erased as the data reaches them. Return false on failure.
+bool store_begin(uint32_t size, uint32_t flags);
+void store_data(const uint8_t *data, uint32_t len);
+bool store_end(uint64_t hash);
+
+uint64_t store_hash(const uint8_t *data, uint32_t len);
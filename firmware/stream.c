@@ -0,0 +1,164 @@
+#include <string.h>
+#include "pico/stdlib.h"
+#include "hardware/clocks.h"
+#include "hardware/dma.h"
+#include "hardware/pio.h"
+#include "tusb.h"
+#include "board_profile.h"  // PCK_PIN, PRD0_PIN, PWRITE_PIN, PWAIT_PIN
+#include "axm.h"
+#include "stream.h"
+#include "stream.pio.h"
+
+// The DMA fills the ring a chunk at a time. The host is sent everything up
+// to the DMA's write address, so a slow trickle goes out right away and does
+// not wait for a whole chunk.
+#define STREAM_CHUNK 1024
+#define STREAM_RING (16 * STREAM_CHUNK)
+
+#define STREAM_MAX_KHZ 20000
+
+static uint8_t ring[STREAM_RING] __attribute__((aligned(4)));
+static uint32_t filled;  // bytes of completed chunks, free running
+static uint32_t sent;    // bytes queued for the host, free running
+static bool dma_running;
+static bool stalled;
+
+#define STREAM_PIO pio0
+
+static int sm = -1;
+static uint offset;
+static int dma_ch = -1;
+
+struct stream_status stream_status;
+
+// Set by the control request, applied by stream_task()
+static volatile bool request_pending;
+static volatile uint16_t request_khz;
+
+bool stream_active(void) {
+  return stream_status.state == STREAM_RUNNING;
+}
+
+static void dma_start(void) {
+  dma_channel_config c = dma_channel_get_default_config(dma_ch);
+
+  channel_config_set_transfer_data_size(&c, DMA_SIZE_32);
+  channel_config_set_dreq(&c, pio_get_dreq(STREAM_PIO, sm, false));
+  channel_config_set_read_increment(&c, false);
+  channel_config_set_write_increment(&c, true);
+  dma_channel_configure(dma_ch, &c, &ring[filled % STREAM_RING], &STREAM_PIO->rxf[sm], STREAM_CHUNK / 4, true);
+  dma_running = true;
+}
+
+// Bytes the DMA has written so far
+static uint32_t produced(void) {
+  if (!dma_running)
+    return filled;
+  return filled + ((uint8_t *)dma_channel_hw_addr(dma_ch)->write_addr - &ring[filled % STREAM_RING]);
+}
+
+static void stream_start(uint32_t khz) {
+  float div;
+
+  if (khz > STREAM_MAX_KHZ)
+    khz = STREAM_MAX_KHZ;
+  div = (float)clock_get_hz(clk_sys) / (khz * 1000.0f * PMOD_STREAM_CYCLES);
+  if (div < 1.0f)
+    div = 1.0f;
+
+  if (sm < 0) {
+    sm = pio_claim_unused_sm(STREAM_PIO, true);
+    offset = pio_add_program(STREAM_PIO, &pmod_stream_program);
+    dma_ch = dma_claim_unused_channel(true);
+  }
+
+  pmod_abort();
+  plen(0, false);  // announce the stream, see stream.h
+  pmod_stream_program_init(STREAM_PIO, sm, offset, PCK_PIN, PRD0_PIN, PWAIT_PIN, div);
+
+  filled = sent = 0;
+  stalled = false;
+  memset(&stream_status, 0, sizeof(stream_status));
+  stream_status.state = STREAM_RUNNING;
+  stream_status.khz = clock_get_hz(clk_sys) / (div * PMOD_STREAM_CYCLES * 1000.0f);
+  dma_start();
+  pio_sm_set_enabled(STREAM_PIO, sm, true);
+}
+
+static void stream_stop(void) {
+  pio_sm_set_enabled(STREAM_PIO, sm, false);
+  dma_channel_abort(dma_ch);
+  dma_running = false;
+  pio_sm_clear_fifos(STREAM_PIO, sm);
+
+  // PCK back to the CPU, one clock with PWRITE high ends the stream
+  gpio_init(PCK_PIN);
+  gpio_set_dir(PCK_PIN, GPIO_OUT);
+  gpio_put(PWRITE_PIN, 1);
+  gpio_put(PCK_PIN, 1);
+  asm volatile("nop");
+  gpio_put(PCK_PIN, 0);
+  gpio_put(PWRITE_PIN, 0);
+
+  stream_status.state = STREAM_IDLE;
+}
+
+bool __time_critical_func(stream_task)(void) {
+  bool busy = false;
+  uint32_t n;
+
+  if (request_pending) {
+    request_pending = false;
+    if (stream_active())
+      stream_stop();
+    if (request_khz)
+      stream_start(request_khz);
+    return true;
+  }
+  if (!stream_active())
+    return false;
+
+  if (dma_running && !dma_channel_is_busy(dma_ch)) {
+    filled += STREAM_CHUNK;
+    dma_running = false;
+  }
+  if (!dma_running) {
+    if (filled + STREAM_CHUNK - sent <= STREAM_RING) {
+      dma_start();
+      stalled = false;
+      busy = true;
+    } else if (!stalled) {
+      // The PIO stalls with it, PCK stops until the host catches up
+      stalled = true;
+      stream_status.stalls++;
+    }
+  }
+
+  // Up to the end of the ring, the rest goes on the next call
+  n = produced() - sent;
+  if (n > STREAM_RING - sent % STREAM_RING)
+    n = STREAM_RING - sent % STREAM_RING;
+  if (n) {
+    n = tud_vendor_n_write(AXM_ITF, &ring[sent % STREAM_RING], n);
+    sent += n;
+    stream_status.bytes += n;
+    busy = busy || n;
+  }
+  return busy;
+}
+
+bool stream_control_xfer_cb(uint8_t rhport, uint8_t stage, tusb_control_request_t const *request) {
+  if (stage != CONTROL_STAGE_SETUP)
+    return true;
+
+  switch (request->bRequest) {
+    case AXM_REQ_STREAM:
+      request_khz = request->wValue;
+      request_pending = true;
+      return tud_control_status(rhport, request);
+
+    case AXM_REQ_STREAM_STATUS:
+      return tud_control_xfer(rhport, request, &stream_status, sizeof(stream_status));
+  }
+  return false;  // stall
+}
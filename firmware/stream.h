@@ -0,0 +1,63 @@
+/*
+  Continuous FPGA -> host stream over the PMOD (AXM) pins.
+
+  The Pico keeps clocking PCK and the FPGA answers every clock like the data
+  phase of an AXM read: two bits on PRD1:PRD0, or PWAIT high when it has
+  nothing to send. Four clocks make a byte, lowest bits first. A PIO state
+  machine generates PCK and samples the pins, DMA moves the words into a
+  ring, and the ring goes out on the AXM IN endpoint as fast as the host
+  takes it. When the host falls behind, the ring fills up and PCK stops
+  until there is room again, so no data is lost. The FPGA only sees a
+  slower clock.
+
+  The bus tells the FPGA about the stream:
+
+    start   LEN = 0 with PWRITE low, no address follows (no AXM
+            transaction uses LEN 0)
+    stop    one clock with PWRITE high
+
+  Whatever the host has not read yet when it stops the stream is dropped,
+  including up to three bytes still in the PIO. A capture should end with a
+  little padding. AXM packets are ignored while the stream runs.
+
+  The host controls it with vendor requests on the AXM interface
+  (recipient interface, wIndex = the AXM interface number):
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "tusb.h"
+
+#define AXM_REQ_STREAM 0x01         // wValue: PCK in kHz, 0 stops the stream
+#define AXM_REQ_STREAM_STATUS 0x02  // IN, struct stream_status
+
+enum {
+  STREAM_IDLE = 0,
+  STREAM_RUNNING = 1,
+};
+
+// Little endian, as it goes over USB
+struct stream_status {
+  uint8_t state;
+  uint8_t reserved[3];
+  uint32_t khz;     // PCK actually used
+  uint32_t bytes;   // sent to the host so far, wraps
+  uint32_t stalls;  // times PCK stopped because the ring was full
+};
+
+/**
+ * @brief Move stream data from the PMOD pins to USB, a scheduler step
+ *
+ * @return false if there was nothing to do
+ */
+bool stream_task(void);
+
+/**
+ * @brief Whether the PMOD pins belong to the stream
+ */
+bool stream_active(void);
+
+/**
+ * @brief Vendor requests on the AXM interface, see tud_vendor_control_xfer_cb()
+ */
+bool stream_control_xfer_cb(uint8_t rhport, uint8_t stage, tusb_control_request_t const *request);
@@ -66,13 +66,13 @@ extern "C" {
 #define CFG_TUD_CDC 1
 #define CFG_TUD_MSC 0
 #define CFG_TUD_MIDI 0
-#define CFG_TUD_VENDOR 2
+#define CFG_TUD_VENDOR 1  // AXM only, JTAG has its own driver (jtag_usb.c)
 
 #define CFG_TUD_CDC_RX_BUFSIZE 256
 #define CFG_TUD_CDC_TX_BUFSIZE 256
 
 #define CFG_TUD_VENDOR_RX_BUFSIZE 128
-#define CFG_TUD_VENDOR_TX_BUFSIZE 64
+#define CFG_TUD_VENDOR_TX_BUFSIZE 256  // a few packets of the PMOD stream (stream.c)
 
 #ifdef __cplusplus
 }
@@ -2,59 +2,92 @@
 #include "pico/stdlib.h"
 #include "pico/binary_info.h"
 #include "pico/multicore.h"
+#include "hardware/sync.h"
 #include "bsp/board.h"
 #include "tusb.h"
 #include "xvcPico.h"
 #include "jtag.h"
+#include "jtag_usb.h"
 #include "axm.h"
+#include "sched.h"
+#include "store.h"
+#include "stream.h"
+#include "mem_layout.h"
 
-void __time_critical_func(core1_entry)() {
+// UART bytes on their way between core 1 (the UART) and core 0 (TinyUSB).
+// Each ring has one writer and one reader, the indices are free running.
+#define UART_RING 256
+typedef struct {
+  uint8_t buf[UART_RING];
+  volatile uint32_t head, tail;
+} uart_ring;
+
+static uart_ring CORE1_DATA uart_rx;  // UART -> CDC
+static uart_ring CORE1_DATA uart_tx;  // CDC -> UART
+
+// Core 1 only keeps the UART FIFOs serviced, so no byte is lost while
+// core 0 is busy with a long JTAG command. It runs from its own SRAM bank,
+// see mem_layout.h.
+void CORE1_FUNC(core1_entry)() {
+  // Lets core 0 park this core while it writes the flash (store.c)
+  multicore_lockout_victim_init();
   while (1) {
-    if (tud_cdc_n_available(0)) {
-      char buf[64];
-      uint32_t count = tud_cdc_n_read(0, buf, sizeof(buf));
-      tud_cdc_n_read_flush(0);
-      for (int i = 0; i < count; i++) {
-        uart_putc(UART_ID, buf[i]);
-      }
+    while (uart_is_readable(UART_ID) && uart_rx.head - uart_rx.tail < UART_RING) {
+      uart_rx.buf[uart_rx.head % UART_RING] = uart_getc(UART_ID);
+      __dmb();
+      uart_rx.head++;
     }
-
-    int i = 0;
-    char str[56];
-    while (uart_is_readable(UART_ID)) {
-      str[i] = uart_getc(UART_ID);
-      i++;
+    while (uart_tx.tail != uart_tx.head && uart_is_writable(UART_ID)) {
+      uart_putc(UART_ID, uart_tx.buf[uart_tx.tail % UART_RING]);
+      __dmb();
+      uart_tx.tail++;
     }
-    str[i] = 0;
-    if (i != 0) {
-      tud_cdc_n_write_str(0, str);
-      tud_cdc_n_write_flush(0);
+  }
+}
+
+// UART forwarding on the TinyUSB side, lowest priority
+static bool uart_task() {
+  bool busy = false;
+  uint32_t n;
+
+  n = UART_RING - (uart_tx.head - uart_tx.tail);
+  if (n && tud_cdc_n_available(0)) {
+    uint8_t c;
+    while (n-- && tud_cdc_n_read(0, &c, 1)) {
+      uart_tx.buf[uart_tx.head % UART_RING] = c;
+      __dmb();
+      uart_tx.head++;
     }
+    busy = true;
+  }
+
+  n = uart_rx.head - uart_rx.tail;
+  if (n) {
+    uint32_t room = tud_cdc_n_write_available(0);
+    if (n > room)
+      n = room;
+    for (uint32_t i = 0; i < n; i++)
+      tud_cdc_n_write_char(0, uart_rx.buf[(uart_rx.tail + i) % UART_RING]);
+    __dmb();
+    uart_rx.tail += n;
+    tud_cdc_n_write_flush(0);
+    busy = busy || n;
   }
+  return busy;
 }
 
-buffer_info buffer_info_jtag;
 buffer_info buffer_info_axm;
 
-static cmd_buffer tx_buf;
+static cmd_buffer JTAG_DATA tx_buf;
 
-void __time_critical_func(from_host_task)() {
-  if ((buffer_info_jtag.busy == false)) {
-    //If tud_task() is called and tud_vendor_read isn't called immediately (i.e before calling tud_task again)
-    //after there is data available, there is a risk that data from 2 BULK OUT transaction will be (partially) combined into one
-    //The DJTAG protocol does not tolerate this.
-    tud_task();  // tinyusb device task
-    if (tud_vendor_n_available(JTAG_ITF)) {
-      uint count = tud_vendor_n_read(JTAG_ITF, buffer_info_jtag.buffer, 64);
-      if (count != 0) {
-        buffer_info_jtag.count = count;
-        buffer_info_jtag.busy = true;
-      }
-    }
-  }
+bool __time_critical_func(from_host_task)() {
+  // JTAG packets are queued by jtag_usb.c from within tud_task()
+  tud_task();  // tinyusb device task
 
   if ((buffer_info_axm.busy == false)) {
-    tud_task();
+    //If tud_task() is called and tud_vendor_read isn't called immediately (i.e before calling tud_task again)
+    //after there is data available, there is a risk that data from 2 BULK OUT transaction will be (partially) combined into one
+    //The AXM protocol does not tolerate this.
     if (tud_vendor_n_available(AXM_ITF)) {
       uint count = tud_vendor_n_read(AXM_ITF, buffer_info_axm.buffer, 64);
       if (count != 0) {
@@ -63,19 +96,45 @@ void __time_critical_func(from_host_task)() {
       }
     }
   }
+  return false;  // one pass is enough, it must not hold up the others
 }
 
-void fetch_command() {
-  if (buffer_info_jtag.busy) {
-    cmd_handle(buffer_info_jtag.buffer, buffer_info_jtag.count, tx_buf);
-    buffer_info_jtag.busy = false;
-  }
+bool __time_critical_func(fetch_command)() {
+  uint8_t *rx_buf;
+  uint32_t count;
+
+  // A replay owns the TAP until it is done, see jtag_replay_active()
+  if (jtag_replay_active() || !jtag_usb_read(&rx_buf, &count))
+    return false;
+  cmd_handle(rx_buf, count, tx_buf);
+  jtag_usb_read_done();
+  return true;
 }
 
-//this is to work around the fact that tinyUSB does not handle setup request automatically
-//Hence this boiler plate code
-bool tud_vendor_control_xfer_cb(__attribute__((unused)) uint8_t rhport, uint8_t stage, __attribute__((unused)) tusb_control_request_t const* request) {
-  if (stage != CONTROL_STAGE_SETUP) return true;
+// Highest priority first. JTAG packets are served between any two steps of
+// the stream, AXM and UART tasks, see sched.h.
+static struct sched_task tasks[] = {
+  { "usb", from_host_task, 0, true },
+  { "jtag", fetch_command, 1000, true },
+  { "replay", jtag_replay_step, 1000, false },
+  { "selftest", jtag_selftest_step, 1000, false },
+  { "stream", stream_task, 200, false },
+  { "axm", pmod_task, 200, false },
+  { "uart", uart_task, 100, false },
+};
+
+// TinyUSB sends every vendor request here, whichever interface it is for.
+// The JTAG interface (jtag_usb.h) and the AXM interface (stream.h) each have
+// their own, anything else is stalled.
+bool tud_vendor_control_xfer_cb(uint8_t rhport, uint8_t stage, tusb_control_request_t const* request) {
+  if (request->bmRequestType_bit.recipient != TUSB_REQ_RCPT_INTERFACE)
+    return false;
+  switch (tu_u16_low(request->wIndex)) {
+    case JTAG_USB_ITF:
+      return jtag_usb_control_xfer_cb(rhport, stage, request);
+    case AXM_USB_ITF:
+      return stream_control_xfer_cb(rhport, stage, request);
+  }
   return false;
 }
 
@@ -95,6 +154,11 @@ int main() {
   gpio_put(tdi_gpio, 0);
   gpio_put(tck_gpio, 0);
   gpio_put(tms_gpio, 1);
+  for (int t = 1; t < GANG_MAX; t++) {
+    gpio_init(gang_tdo_gpio[t]);
+    gpio_set_dir(gang_tdo_gpio[t], GPIO_IN);
+    gpio_pull_up(gang_tdo_gpio[t]);
+  }
 
   // Set up our UART with the required speed.
   uart_init(UART_ID, BAUD_RATE);
@@ -122,14 +186,18 @@ int main() {
   gpio_put(PWD0_PIN, 0);
   gpio_put(PWD1_PIN, 0);
 
+#ifdef LED_PIN
   // LED config
   gpio_init(LED_PIN);
   gpio_set_dir(LED_PIN, GPIO_OUT);
+#endif
 
   multicore_launch_core1(core1_entry);
-  while (1) {
-    from_host_task();
-    fetch_command();
-    pmod_task();
-  }
+
+  // Configure the FPGA from the stored image, if there is one to autorun
+  uint32_t image_size, image_flags;
+  if (store_image(&image_size, &image_flags) && (image_flags & STORE_AUTORUN))
+    jtag_replay_start(false);
+
+  sched_run(tasks, sizeof(tasks) / sizeof(tasks[0]));
 }
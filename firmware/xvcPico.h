@@ -1,7 +1,6 @@
-#define UART_ID uart0
+#include "board_profile.h"  // UART_ID, UART_TX_PIN, UART_RX_PIN
+
 #define BAUD_RATE 115200
-#define UART_TX_PIN 0
-#define UART_RX_PIN 1
 
 typedef uint8_t cmd_buffer[64];
 typedef struct buffer_info {